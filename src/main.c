@@ -1,3 +1,7 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -9,6 +13,12 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <poll.h>
 
 /*********** defines   *****************/
 
@@ -27,19 +37,56 @@ enum editorKey {
   DEL_KEY
 };
 
+// Record types in the crash journal
+enum journalOp {
+  J_INSERT_ROW = 1,
+  J_DELETE_ROW,
+  J_INSERT_CHAR,
+  J_DELETE,
+  J_APPEND,
+  J_TRUNCATE,
+  J_SET_ROW
+};
+
 /*********** data   *****************/
 
 typedef struct erow {
   int size;
   char *chars;
+  int base;           // line of the diff base this row matches, -1 if none
+  unsigned char diff; // diff gutter marker, see enum diffMark
+  unsigned char hashed;    // hash below is up to date
+  unsigned long long hash; // of chars, see diffRowHash()
 } erow;
 
+// A row buffer swapped out by a bulk operation, kept so the operation
+// can be undone by swapping it back in.
+typedef struct undoRow {
+  int at;
+  int size;
+  char *chars;
+} undoRow;
+
+struct editorUndo {
+  undoRow *rows;
+  int numrows;
+  int cx, cy;
+  unsigned long edits; // E.edits right after the step; any later edit invalidates it
+};
+
+// A cursor besides the one at E.cx, E.cy
+typedef struct editorCursor {
+  int y, x;
+} editorCursor;
+
 struct editorConfig {
   int cx, cy;
   int rowoff;
   int coloff;
-  int screenrows;
+  int screenrows;      // text area of the focused view
   int screencols;
+  int termrows;        // the whole terminal
+  int termcols;
   int numrows;
   erow *row;
   char *filename;
@@ -49,12 +96,71 @@ struct editorConfig {
   int sel_start_x;
   int sel_start_y;
   int selecting;
+  int block;           // the selection is a rectangle between the two corners
+  editorCursor *cursors; // sorted by row, then column; cx, cy is not among them
+  int ncursors;
   char *clipboard;
+  unsigned long edits; // number of edits applied to the buffer, never reset
+  int loading;         // rows are still arriving from the loader thread
+  int viewer;          // read-only sparse-index mode, E.row is unused
+  int follow;          // appending to the file extends the buffer (tail -f)
+  int gutter;          // diff markers are drawn left of the line numbers
+  struct editorUndo undo;
   struct termios orig_termios;
 };
 
 struct editorConfig E;
 
+// Set while a prompt reads keys. Its caller may hold on to a cursor
+// position, so changes that move or drop rows (follow, recovery, merges
+// from disk) wait until it returns; loading only appends.
+static int prompt_open;
+
+/*********** prototypes   *****************/
+
+void editorSetStatusMessage(const char *fmt, ...);
+void editorRefreshScreen(void);
+int editorPollEvents(void);
+int editorReadKey(void);
+void editorJournalRecord(int op, int a, int b, const char *s, int len);
+void editorJournalOpen(void);
+void editorJournalReset(void);
+void editorJournalClose(int discard);
+void editorJournalBatchBegin(void);
+void editorJournalBatchEnd(void);
+void editorWordsCountRow(erow *row, int delta);
+void editorWordsEditBegin(erow *row, int at, int len);
+void editorWordsEditEnd(erow *row);
+void editorWordsRowChanged(const char *old, int oldsize, erow *row);
+void editorWordsBatchBegin(void);
+void editorWordsBatchEnd(void);
+unsigned long long editorHashLine(const char *s, int len);
+void editorDiffLoadedRow(int at, unsigned long long hash);
+void editorDiffLoadedRowGrew(int at);
+void editorDiffRowChanged(int at);
+void editorDiffRowInserted(int at);
+void editorDiffRowDeleted(int at);
+void editorDiffSaved(void);
+const char *editorDiffMarker(int at);
+int editorDiskLines(const unsigned long long **lines);
+erow *editorRow(int at);
+void editorDiskOpened(const struct stat *st);
+void editorDiskLoadedRow(unsigned long long hash);
+void editorDiskLoadedRowGrew(unsigned long long hash);
+void editorDiskFollowed(const struct stat *st);
+void editorDiskSaved(void);
+void editorFollowSaved(off_t size);
+int editorDiskBeforeSave(void);
+int editorBufferIndex(int *count);
+void editorViewsDamage(int lo, int hi);
+void editorViewsRowInserted(int at);
+void editorViewsRowDeleted(int at);
+void editorMoveCursor(int key);
+void editorCursorsClear(void);
+int editorCursorsFrom(int y);
+char *editorCursorsBlockText(size_t *buflen);
+void editorCursorsDeleteBlock(void);
+
 /*********** append buffer   *****************/
 struct abuf {
   char *b;
@@ -76,6 +182,34 @@ void abFree(struct abuf *ab) {
   free(ab->b);
 }
 
+// Unsigned LEB128, used by the on-disk journal and line index formats
+// Encode v into buf, which has room for 10 bytes; returns the length.
+int putVarint(char *buf, unsigned long long v) {
+  int n = 0;
+  do {
+    buf[n] = v & 0x7f;
+    v >>= 7;
+    if (v) buf[n] |= 0x80;
+    n++;
+  } while (v);
+  return n;
+}
+
+void abAppendVarint(struct abuf *ab, unsigned long long v) {
+  char buf[10];
+  abAppend(ab, buf, putVarint(buf, v));
+}
+
+int getVarint(const char **p, const char *end, unsigned long long *v) {
+  *v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char b = *(*p)++;
+    *v |= (unsigned long long)(b & 0x7f) << shift;
+    if (!(b & 0x80)) return 0;
+  }
+  return -1;
+}
+
 
 /*********** terminal   *****************/
 
@@ -92,6 +226,7 @@ int editorReadKey(void) {
   char c;
   while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
     if (nread == -1 && errno != EAGAIN) die("read");
+    if (editorPollEvents()) editorRefreshScreen();
   }
 
   if (c == '\x1b') {
@@ -193,459 +328,4365 @@ int editorLineNumberWidth(void) {
     max_line /= 10;
     digits++;
   }
-  return digits + 1; // +1 for space after line number
+  return digits + 1 + E.gutter; // +1 for space after line number, +1 for the diff gutter
 }
 
-/*********** output   *****************/
+/*********** row pool   *****************/
 
-void editorSetStatusMessage(const char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-  va_end(ap);
-  E.statusmsg_time = time(NULL);
+// Row text of every buffer comes from one pool instead of a malloc() per
+// row. Sizes are rounded up to a class (16-byte steps up to 256 bytes,
+// then four steps per doubling up to ROW_POOL_MAX), each class keeps a
+// free list threaded through its freed chunks, and new chunks are carved
+// out of ROW_POOL_BLOCK blocks. The class follows from the row size, so
+// nothing is stored next to a chunk. A row that shrinks keeps its chunk,
+// which is then bigger than its class says; freeing it by the smaller
+// size only wastes the difference. Threads that make many rows at once
+// (the loader, replace workers) carve from a block of their own through
+// a rowCarver and only take the lock once per block.
+
+#define ROW_POOL_BLOCK (1 << 20)
+#define ROW_POOL_MAX 65536 // bigger rows come straight from malloc()
+#define ROW_POOL_CLASSES 48
+
+typedef struct rowCarver {
+  char *p;
+  char *end;
+} rowCarver;
+
+#define ROW_CARVER_INIT {NULL, NULL}
+
+static struct {
+  pthread_mutex_t lock;
+  void *free[ROW_POOL_CLASSES];
+  rowCarver main; // block rowAlloc() carves from
+} rowpool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Class of a chunk of n bytes, 0 < n <= ROW_POOL_MAX.
+static int rowClass(int n) {
+  if (n <= 256) return n <= 16 ? 0 : (n + 15) / 16 - 1;
+  int shift = 8;
+  while ((n - 1) >> (shift + 1)) shift++;
+  return 16 + (shift - 8) * 4 + ((n - 1) >> (shift - 2)) - 4;
 }
 
-void editorScroll(void) {
-  if (E.cy < E.rowoff) {
-    E.rowoff = E.cy;
+static int rowClassSize(int c) {
+  if (c < 16) return (c + 1) * 16;
+  int shift = 8 + (c - 16) / 4;
+  return (1 << shift) + ((c - 16) % 4 + 1) * (1 << (shift - 2));
+}
+
+// Put the unused tail of a block on the free lists. Caller holds the lock.
+static void rowPoolRecycle(char *p, long len) {
+  while (len >= 16) {
+    int c = rowClass(len < ROW_POOL_MAX ? len : ROW_POOL_MAX);
+    if (rowClassSize(c) > len) c--;
+    *(void **)p = rowpool.free[c];
+    rowpool.free[c] = p;
+    p += rowClassSize(c);
+    len -= rowClassSize(c);
   }
-  if (E.cy >= E.rowoff + E.screenrows) {
-    E.rowoff = E.cy - E.screenrows + 1;
+}
+
+static char *rowBlockCarve(rowCarver *rc, int csize) {
+  if (rc->end - rc->p < csize) {
+    rc->p = malloc(ROW_POOL_BLOCK);
+    if (rc->p == NULL) die("malloc");
+    rc->end = rc->p + ROW_POOL_BLOCK;
   }
-  
-  int available_width = E.screencols - editorLineNumberWidth();
-  if (E.cx < E.coloff) {
-    E.coloff = E.cx;
+  char *p = rc->p;
+  rc->p += csize;
+  return p;
+}
+
+// Room for a row of size chars plus the terminating NUL.
+char *rowAlloc(int size) {
+  if (size + 1 > ROW_POOL_MAX) return malloc(size + 1);
+  int c = rowClass(size + 1);
+  pthread_mutex_lock(&rowpool.lock);
+  char *p = rowpool.free[c];
+  if (p) {
+    rowpool.free[c] = *(void **)p;
+  } else {
+    if (rowpool.main.end - rowpool.main.p < rowClassSize(c))
+      rowPoolRecycle(rowpool.main.p, rowpool.main.end - rowpool.main.p);
+    p = rowBlockCarve(&rowpool.main, rowClassSize(c));
   }
-  if (E.cx >= E.coloff + available_width) {
-    E.coloff = E.cx - available_width + 1;
+  pthread_mutex_unlock(&rowpool.lock);
+  return p;
+}
+
+void rowFree(char *p, int size) {
+  if (p == NULL) return;
+  if (size + 1 > ROW_POOL_MAX) {
+    free(p);
+    return;
   }
+  int c = rowClass(size + 1);
+  pthread_mutex_lock(&rowpool.lock);
+  *(void **)p = rowpool.free[c];
+  rowpool.free[c] = p;
+  pthread_mutex_unlock(&rowpool.lock);
 }
 
-void editorDrawRows(struct abuf *ab) {
-  int y;
-  int line_num_width = editorLineNumberWidth();
+// The realloc() of the pool: the contents up to the smaller size (and
+// its NUL) are kept.
+char *rowResize(char *p, int oldsize, int newsize) {
+  int oldbig = oldsize + 1 > ROW_POOL_MAX, newbig = newsize + 1 > ROW_POOL_MAX;
+  if (oldbig && newbig) return realloc(p, newsize + 1);
+  if (!oldbig && !newbig && rowClass(oldsize + 1) >= rowClass(newsize + 1)) return p;
+  char *q = rowAlloc(newsize);
+  memcpy(q, p, (oldsize < newsize ? oldsize : newsize) + 1);
+  rowFree(p, oldsize);
+  return q;
+}
 
-  // Determine the selection start and end points, regardless of cursor direction
-  int start_y, start_x, end_y, end_x;
-  int selection_is_active = E.selecting;
-  if (selection_is_active) {
-    if (E.sel_start_y < E.cy || (E.sel_start_y == E.cy && E.sel_start_x <= E.cx)) {
-      start_y = E.sel_start_y;
-      start_x = E.sel_start_x;
-      end_y = E.cy;
-      end_x = E.cx;
-    } else {
-      start_y = E.cy;
-      start_x = E.cx;
-      end_y = E.sel_start_y;
-      end_x = E.sel_start_x;
-    }
-  }
+// Hand back what is left of the carver's block.
+void rowCarverDone(rowCarver *rc) {
+  pthread_mutex_lock(&rowpool.lock);
+  rowPoolRecycle(rc->p, rc->end - rc->p);
+  pthread_mutex_unlock(&rowpool.lock);
+  rc->p = rc->end = NULL;
+}
 
-  for (y = 0; y < E.screenrows; y++) {
-    int filerow = y + E.rowoff;
-    
-    // Draw line number
-    char line_num[16];
-    if (filerow >= E.numrows) {
-      snprintf(line_num, sizeof(line_num), "%*s", line_num_width, "~");
-    } else {
-      snprintf(line_num, sizeof(line_num), "%*d ", line_num_width - 1, filerow + 1);
-    }
-    abAppend(ab, line_num, line_num_width);
-    
-    if (filerow >= E.numrows) {
-      if (E.numrows == 0 && y == E.screenrows / 3) {
-        char welcome[80];
-        int welcomelen = snprintf(welcome, sizeof(welcome), "Cilo editor -- version 0.0.1");
-        int available_width = E.screencols - line_num_width;
-        if (welcomelen > available_width) welcomelen = available_width;
-        int padding = (available_width - welcomelen) / 2;
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
-      }
-    } else {
-      erow *row = &E.row[filerow];
-      int available_width = E.screencols - line_num_width;
-      
-      // Highlighting Logic
-      int is_row_selected = selection_is_active && (filerow >= start_y && filerow <= end_y);
-      int sel_start_col = is_row_selected ? (filerow == start_y ? start_x : 0) : -1;
-      int sel_end_col = is_row_selected ? (filerow == end_y ? end_x : row->size) : -1;
-      
-      // Selection highlighting overrides search highlighting
-      char *highlight_search = E.highlight_query;
-      if (is_row_selected) {
-        highlight_search = NULL;
-      }
-      
-      int visible_len = row->size - E.coloff;
-      if (visible_len < 0) visible_len = 0;
-      if (visible_len > available_width) visible_len = available_width;
-      char *visible_start = row->chars + E.coloff;
+// rowAlloc() for a thread making many rows in a row.
+char *rowCarve(rowCarver *rc, int size) {
+  if (size + 1 > ROW_POOL_MAX) return malloc(size + 1);
+  int csize = rowClassSize(rowClass(size + 1));
+  if (rc->end - rc->p < csize) rowCarverDone(rc);
+  return rowBlockCarve(rc, csize);
+}
 
-      if (!is_row_selected && !highlight_search) {
-        abAppend(ab, visible_start, visible_len);
-      } else {
-        // Find intersection of visible area and selection area
-        int vis_sel_start = sel_start_col != -1 ? (E.coloff > sel_start_col ? E.coloff : sel_start_col) : -1;
-        int vis_sel_end = sel_end_col != -1 ? ((E.coloff + visible_len) < sel_end_col ? (E.coloff + visible_len) : sel_end_col) : -1;
+/*********** line index cache *****************/
 
-        if (is_row_selected && vis_sel_start < vis_sel_end) {
-          // Draw with selection highlighting
-          int pre_len = vis_sel_start - E.coloff;
-          if (pre_len > 0) abAppend(ab, visible_start, pre_len);
-          
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, row->chars + vis_sel_start, vis_sel_end - vis_sel_start);
-          abAppend(ab, "\x1b[m", 3);
+// The line start offsets of a file are kept in a sidecar file under
+// $XDG_CACHE_HOME/cilo (or ~/.cache/cilo), named after a hash of the
+// file's absolute path. The header records the size, mtime, inode and
+// device the offsets were taken from, so a cheap fstat() decides whether
+// they can be trusted; the offsets follow as varint deltas. Normal mode
+// stores every line start and slices rows at them without looking for
+// newlines, viewer mode stores its checkpoints and needs no scan at all.
+// The last cursor and scroll position ride along in the header.
 
-          int post_start_offset = vis_sel_end - E.coloff;
-          int post_len = visible_len - post_start_offset;
-          if (post_len > 0) abAppend(ab, visible_start + post_start_offset, post_len);
-        } else if (highlight_search) {
-          // Draw with search highlighting
-            char *current = visible_start;
-            int query_len = strlen(highlight_search);
-            char *end_of_visible = visible_start + visible_len;
-            
-            while(current < end_of_visible) {
-                char *match = strcasestr_impl(current, highlight_search);
-                if (match && match < end_of_visible) {
-                    abAppend(ab, current, match - current);
-                    abAppend(ab, "\x1b[7m", 4);
-                    int match_len = (match + query_len > end_of_visible) ? (end_of_visible - match) : query_len;
-                    abAppend(ab, match, match_len);
-                    abAppend(ab, "\x1b[m", 3);
-                    current = match + query_len;
-                } else {
-                    abAppend(ab, current, end_of_visible - current);
-                    break;
-                }
-            }
-        } else {
-            abAppend(ab, visible_start, visible_len);
-        }
+#define INDEX_MAGIC "CILOIDX1"
+
+typedef struct indexHeader {
+  char magic[8];
+  long long size;
+  long long mtime_sec;
+  long long mtime_nsec;
+  long long ino;
+  long long dev;
+  long long numlines;
+  long long noffsets;
+  long long datalen;  // bytes of varint offsets after the path
+  int stride;         // offsets[i] is the start of line i * stride
+  int partial;        // the file did not end with a newline
+  int cx, cy;
+  int rowoff, coloff;
+  int pathlen;        // the path follows the header, to rule out hash collisions
+  int unused;
+} indexHeader;
+
+struct lineIndex {
+  char *path;          // of the cache file, NULL when there is none to use
+  char *key;           // absolute path of the edited file
+  struct stat st;      // of the edited file when it was opened or saved
+  // A valid cache read by editorIndexOpen()
+  int valid;
+  off_t *offsets;
+  long long noffsets;
+  long long numlines;
+  int stride;
+  int partial;
+  int cx, cy, rowoff, coloff;
+};
+
+static struct lineIndex *lineindex; // of the active buffer
+
+static void indexFillHeader(const struct lineIndex *li, indexHeader *h, const struct stat *st) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, INDEX_MAGIC, sizeof(h->magic));
+  h->size = st->st_size;
+  h->mtime_sec = st->st_mtim.tv_sec;
+  h->mtime_nsec = st->st_mtim.tv_nsec;
+  h->ino = st->st_ino;
+  h->dev = st->st_dev;
+  h->pathlen = strlen(li->key);
+}
+
+static int indexSameFile(const struct stat *a, const struct stat *b) {
+  return a->st_size == b->st_size && a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+    a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static int indexMatches(const struct lineIndex *li, const indexHeader *h, const struct stat *st) {
+  indexHeader want;
+  indexFillHeader(li, &want, st);
+  return memcmp(h->magic, want.magic, sizeof(h->magic)) == 0 && h->size == want.size &&
+    h->mtime_sec == want.mtime_sec && h->mtime_nsec == want.mtime_nsec &&
+    h->ino == want.ino && h->dev == want.dev && h->pathlen == want.pathlen;
+}
+
+// Read the header and path of an index file; 0 if it describes st.
+static int indexReadHeader(const struct lineIndex *li, int fd, indexHeader *h,
+                           const struct stat *st) {
+  if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) || !indexMatches(li, h, st)) return -1;
+  char *path = malloc(h->pathlen);
+  int ok = pread(fd, path, h->pathlen, sizeof(*h)) == h->pathlen &&
+    memcmp(path, li->key, h->pathlen) == 0;
+  free(path);
+  return ok ? 0 : -1;
+}
+
+// Work out where the index of filename lives and load it if it is still
+// valid for the file described by st.
+void editorIndexOpen(const char *filename, const struct stat *st) {
+  lineindex->valid = 0;
+  lineindex->st = *st;
+  lineindex->key = realpath(filename, NULL);
+  if (lineindex->key == NULL) return;
+
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[PATH_MAX];
+  if (xdg && xdg[0]) snprintf(dir, sizeof(dir), "%s", xdg);
+  else if (home && home[0]) snprintf(dir, sizeof(dir), "%s/.cache", home);
+  else return;
+  mkdir(dir, 0700);
+  size_t dirlen = strlen(dir);
+  snprintf(dir + dirlen, sizeof(dir) - dirlen, "/cilo");
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) return;
+
+  size_t len = strlen(dir) + 22;
+  lineindex->path = malloc(len);
+  snprintf(lineindex->path, len, "%s/%016llx.idx", dir,
+    editorHashLine(lineindex->key, strlen(lineindex->key)));
+
+  int fd = open(lineindex->path, O_RDONLY);
+  if (fd == -1) return;
+  indexHeader h;
+  char *data = NULL;
+  // Every offset takes at least a byte, and there is one per stride lines
+  // (plus the one at 0 when the stride is above 1)
+  if (indexReadHeader(lineindex, fd, &h, st) == 0 && h.stride > 0 && h.noffsets > 0 &&
+      h.datalen > 0 && h.datalen <= INT_MAX && h.noffsets <= h.datalen &&
+      h.numlines >= (h.noffsets - 1) * h.stride && h.numlines <= h.noffsets * h.stride) {
+    data = malloc(h.datalen);
+    if (data && pread(fd, data, h.datalen, sizeof(h) + h.pathlen) == h.datalen &&
+        (lineindex->offsets = malloc(sizeof(off_t) * h.noffsets)) != NULL) {
+      const char *p = data;
+      const char *end = data + h.datalen;
+      unsigned long long v;
+      off_t off = 0;
+      long long i;
+      for (i = 0; i < h.noffsets && getVarint(&p, end, &v) == 0; i++) {
+        // Line starts begin at 0 and strictly increase
+        if ((i == 0) != (v == 0)) break;
+        off += v;
+        if (off > st->st_size) break;
+        lineindex->offsets[i] = off;
+      }
+      if (i == h.noffsets) {
+        lineindex->valid = 1;
+        lineindex->noffsets = h.noffsets;
+        lineindex->numlines = h.numlines;
+        lineindex->stride = h.stride;
+        lineindex->partial = h.partial;
+        lineindex->cx = h.cx;
+        lineindex->cy = h.cy;
+        lineindex->rowoff = h.rowoff;
+        lineindex->coloff = h.coloff;
+      } else {
+        free(lineindex->offsets);
+        lineindex->offsets = NULL;
       }
     }
-    
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
+  free(data);
+  close(fd);
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines",
-    E.filename ? E.filename : "[No Name]", E.numrows);
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-    E.cy + 1, E.numrows);
-  if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
+// Write a fresh index for the file described by st, replacing the old
+// one atomically. Safe to call from the loader thread: it only reads the
+// lineindex fields that are fixed once editorIndexOpen() returns.
+static void indexWrite(const struct lineIndex *li, const struct stat *st, const off_t *offsets,
+                       long long noffsets, int stride, long long numlines, int partial) {
+  if (li->path == NULL) return;
+  struct abuf ab = ABUF_INIT;
+  indexHeader h;
+  indexFillHeader(li, &h, st);
+  h.numlines = numlines;
+  h.noffsets = noffsets;
+  h.stride = stride;
+  h.partial = partial;
+  if (li->valid) {
+    // Keep the position until the main thread records a newer one
+    h.cx = li->cx;
+    h.cy = li->cy;
+    h.rowoff = li->rowoff;
+    h.coloff = li->coloff;
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  abAppend(&ab, (char *)&h, sizeof(h));
+  abAppend(&ab, li->key, h.pathlen);
+  off_t prev = 0;
+  for (long long i = 0; i < noffsets; i++) {
+    abAppendVarint(&ab, offsets[i] - prev);
+    prev = offsets[i];
+  }
+  h.datalen = ab.len - sizeof(h) - h.pathlen;
+  memcpy(ab.b, &h, sizeof(h));
+
+  size_t len = strlen(li->path) + 8;
+  char *tmp = malloc(len);
+  snprintf(tmp, len, "%s.XXXXXX", li->path);
+  int fd = mkstemp(tmp);
+  if (fd != -1) {
+    int ok = write(fd, ab.b, ab.len) == ab.len;
+    close(fd);
+    if (!ok || rename(tmp, li->path) == -1) unlink(tmp);
+  }
+  free(tmp);
+  abFree(&ab);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
-  int msglen = strlen(E.statusmsg);
-  if (msglen > E.screencols) msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+// The buffer was just written to disk: index the rows as saved.
+void editorIndexSaved(void) {
+  if (lineindex->path == NULL || stat(E.filename, &lineindex->st) == -1) return;
+  off_t *offsets = malloc(sizeof(off_t) * (E.numrows ? E.numrows : 1));
+  off_t off = 0;
+  for (int i = 0; i < E.numrows; i++) {
+    offsets[i] = off;
+    off += E.row[i].size + 1;
+  }
+  indexWrite(lineindex, &lineindex->st, offsets, E.numrows, 1, E.numrows, 0);
+  free(offsets);
 }
 
-void editorRefreshScreen(void) {
-  editorScroll();
-  struct abuf ab = ABUF_INIT;
+// Put the cursor back where the previous session left it.
+void editorIndexRestorePosition(void) {
+  if (!lineindex->valid || E.cx != 0 || E.cy != 0 || E.rowoff != 0) return;
+  E.cy = lineindex->cy < 0 ? 0 : lineindex->cy > E.numrows ? E.numrows : lineindex->cy;
+  E.rowoff = lineindex->rowoff < 0 ? 0 : lineindex->rowoff > E.cy ? E.cy : lineindex->rowoff;
+  E.coloff = lineindex->coloff < 0 ? 0 : lineindex->coloff;
+  erow *row = E.cy < E.numrows ? editorRow(E.cy) : NULL;
+  int rowlen = row ? row->size : 0;
+  E.cx = lineindex->cx < 0 ? 0 : lineindex->cx > rowlen ? rowlen : lineindex->cx;
+}
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+// Record the cursor and scroll position in the index on the way out, as
+// long as the index still describes the file on disk.
+void editorIndexSavePosition(void) {
+  if (lineindex->path == NULL || E.filename == NULL) return;
+  struct stat st;
+  if (stat(E.filename, &st) == -1) return;
+  int fd = open(lineindex->path, O_RDWR);
+  if (fd == -1) return;
+  indexHeader h;
+  if (indexReadHeader(lineindex, fd, &h, &st) == 0) {
+    h.cx = E.cx;
+    h.cy = E.cy;
+    h.rowoff = E.rowoff;
+    h.coloff = E.coloff;
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) unlink(lineindex->path);
+  }
+  close(fd);
+}
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+/*********** background loading *****************/
 
-  char buf[32];
-  int line_num_width = editorLineNumberWidth();
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.cx - E.coloff) + line_num_width + 1);
-  abAppend(&ab, buf, strlen(buf));
+#define LOAD_CHUNK_SIZE (1 << 20)
+#define LOAD_BATCH_ROWS 8192
+#define LOAD_PUBLISH_MS 50
+#define VIEWER_CHECKPOINT_LINES 2048 // viewer mode indexes every Nth line
 
-  abAppend(&ab, "\x1b[?25h", 6);
+// Rows parsed by the loader thread, waiting to be appended to E.row by
+// the main thread. The loader never touches E directly.
+typedef struct loadBatch {
+  erow *rows;
+  unsigned long long *hashes; // for the diff base, computed off the main thread
+  int numrows;
+  struct loadBatch *next;
+} loadBatch;
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+struct loaderState {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int fd;
+  struct lineIndex *index; // of the same buffer, for the thread
+  loadBatch *head, *tail;
+  long long bytes_read;
+  long long total_bytes; // -1 when the size is unknown (pipes)
+  int done;
+  int error;
+  // Viewer mode: only the line count and checkpoint offsets are published
+  long long numlines;
+  off_t *checkpoints;  // handed over to the viewer once loading is done
+  int ncheckpoints;
+  int checkpointcap;
+  int partial; // the file did not end with a newline
+};
+
+static struct loaderState *loader; // of the active buffer
+
+static void loaderStateInit(struct loaderState *ld) {
+  *ld = (struct loaderState){ .fd = -1 };
+  pthread_mutex_init(&ld->lock, NULL);
 }
 
-/*********** file i/o *****************/
+static long long monotonicMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++) {
-    totlen += E.row[j].size + 1;
-  }
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+static void loaderPublish(struct loaderState *ld, loadBatch **batch, long long bytes_read) {
+  pthread_mutex_lock(&ld->lock);
+  if (*batch) {
+    if (ld->tail) ld->tail->next = *batch;
+    else ld->head = *batch;
+    ld->tail = *batch;
   }
-  return buf;
+  ld->bytes_read = bytes_read;
+  pthread_mutex_unlock(&ld->lock);
+  *batch = NULL;
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
-
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    int at = E.numrows;
-    E.row[at].size = linelen;
-    E.row[at].chars = malloc(linelen + 1);
-    memcpy(E.row[at].chars, line, linelen);
-    E.row[at].chars[linelen] = '\0';
-    E.numrows++;
+static void loaderAddRow(rowCarver *rc, loadBatch **batch, const char *s, size_t len) {
+  while (len > 0 && (s[len - 1] == '\r' || s[len - 1] == '\n')) len--;
+  if (*batch == NULL) {
+    *batch = malloc(sizeof(loadBatch));
+    (*batch)->rows = malloc(sizeof(erow) * LOAD_BATCH_ROWS);
+    (*batch)->hashes = malloc(sizeof(unsigned long long) * LOAD_BATCH_ROWS);
+    (*batch)->numrows = 0;
+    (*batch)->next = NULL;
   }
-  free(line);
-  fclose(fp);
+  (*batch)->hashes[(*batch)->numrows] = editorHashLine(s, len);
+  erow *row = &(*batch)->rows[(*batch)->numrows++];
+  row->size = len;
+  row->chars = rowCarve(rc, len);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
 }
 
-void editorSave(void) {
-  if (E.filename == NULL) return;
-  int len;
-  char *buf = editorRowsToString(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
+static void loaderAddStart(off_t **starts, long long *n, long long *cap, off_t off) {
+  if (*n == *cap) {
+    *cap = *cap ? *cap * 2 : 1024;
+    *starts = realloc(*starts, sizeof(off_t) * *cap);
   }
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  (*starts)[(*n)++] = off;
 }
 
-/*********** editor operations *****************/
+// Store a freshly built index, unless the file changed while it was read
+static void loaderWriteIndex(struct loaderState *ld, const off_t *starts, long long n,
+                             int stride, long long numlines, int partial) {
+  struct stat st;
+  if (fstat(ld->fd, &st) == 0 && indexSameFile(&st, &ld->index->st))
+    indexWrite(ld->index, &st, starts, n, stride, numlines, partial);
+}
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numrows) return;
-  
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+static void *loaderThread(void *arg) {
+  struct loaderState *ld = arg;
+  char *buf = malloc(LOAD_CHUNK_SIZE);
+  char *partial = NULL; // start of a line split across reads
+  size_t partlen = 0;
+  long long bytes_read = 0;
+  long long last_publish = monotonicMs();
+  loadBatch *batch = NULL;
+  rowCarver rc = ROW_CARVER_INIT;
+  int err = 0;
+  // Line starts for the index cache, when there is one to write
+  off_t *starts = NULL;
+  long long nstarts = 0, startscap = 0;
+  off_t linestart = 0;
+
+  while (1) {
+    // A pipe that has gone quiet still gets the rows parsed so far on
+    // screen, rather than holding them until the next read returns
+    if (batch && ld->total_bytes < 0) {
+      struct pollfd pfd = { .fd = ld->fd, .events = POLLIN };
+      long long wait = LOAD_PUBLISH_MS - (monotonicMs() - last_publish);
+      if (wait <= 0 || poll(&pfd, 1, wait) == 0) {
+        loaderPublish(ld, &batch, bytes_read);
+        last_publish = monotonicMs();
+      }
+    }
+
+    ssize_t n = read(ld->fd, buf, LOAD_CHUNK_SIZE);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      err = errno;
+      break;
+    }
+    if (n == 0) break;
+    bytes_read += n;
+
+    char *p = buf;
+    char *end = buf + n;
+    char *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+      if (ld->index->path) {
+        loaderAddStart(&starts, &nstarts, &startscap, linestart);
+        linestart = bytes_read - n + (nl - buf) + 1;
+      }
+      if (partlen) {
+        partial = realloc(partial, partlen + (nl - p));
+        memcpy(partial + partlen, p, nl - p);
+        loaderAddRow(&rc, &batch, partial, partlen + (nl - p));
+        partlen = 0;
+      } else {
+        loaderAddRow(&rc, &batch, p, nl - p);
+      }
+      p = nl + 1;
+      if (batch->numrows == LOAD_BATCH_ROWS) {
+        loaderPublish(ld, &batch, bytes_read);
+        last_publish = monotonicMs();
+      }
+    }
+    if (p < end) {
+      partial = realloc(partial, partlen + (end - p));
+      memcpy(partial + partlen, p, end - p);
+      partlen += end - p;
+    }
+
+    // Slow producers (pipes) still get their rows on screen promptly
+    if (monotonicMs() - last_publish >= LOAD_PUBLISH_MS) {
+      loaderPublish(ld, &batch, bytes_read);
+      last_publish = monotonicMs();
+    }
+  }
+  if (partlen) loaderAddRow(&rc, &batch, partial, partlen);
+  int ends_partial = partlen > 0;
+  free(partial);
+  free(buf);
+  rowCarverDone(&rc);
+
+  if (ld->index->path && !err) {
+    if (ends_partial) loaderAddStart(&starts, &nstarts, &startscap, linestart);
+    loaderWriteIndex(ld, starts, nstarts, 1, nstarts, ends_partial);
+  }
+  free(starts);
+
+  loaderPublish(ld, &batch, bytes_read);
+  pthread_mutex_lock(&ld->lock);
+  ld->partial = ends_partial;
+  ld->error = err;
+  ld->done = 1;
+  pthread_mutex_unlock(&ld->lock);
+  return NULL;
+}
+
+// Normal mode with a valid line index: rows are cut at the known line
+// starts, so the text is copied but never scanned for newlines.
+static void *loaderSliceThread(void *arg) {
+  struct loaderState *ld = arg;
+  const off_t *starts = ld->index->offsets;
+  long long nlines = ld->index->noffsets;
+  off_t size = ld->index->st.st_size;
+  size_t cap = LOAD_CHUNK_SIZE;
+  char *buf = malloc(cap);
+  size_t len = 0;  // bytes held in buf
+  off_t base = 0;  // file offset of buf[0]
+  long long bytes_read = 0;
+  long long last_publish = monotonicMs();
+  loadBatch *batch = NULL;
+  rowCarver rc = ROW_CARVER_INIT;
+  int err = 0;
+
+  for (long long line = 0; line < nlines; ) {
+    off_t end = line + 1 < nlines ? starts[line + 1] : size;
+    if (end > base + (off_t)len) {
+      // Keep the unfinished line, then read more after it
+      size_t keep = base + len - starts[line];
+      memmove(buf, buf + (starts[line] - base), keep);
+      len = keep;
+      base = starts[line];
+      if ((size_t)(end - base) > cap) {
+        cap = end - base;
+        buf = realloc(buf, cap);
+      }
+      ssize_t n = read(ld->fd, buf + len, cap - len);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        err = errno;
+        break;
+      }
+      if (n == 0) break;
+      len += n;
+      bytes_read += n;
+      if (monotonicMs() - last_publish >= LOAD_PUBLISH_MS) {
+        loaderPublish(ld, &batch, bytes_read);
+        last_publish = monotonicMs();
+      }
+      continue;
+    }
+    loaderAddRow(&rc, &batch, buf + (starts[line] - base), end - starts[line]);
+    line++;
+    if (batch->numrows == LOAD_BATCH_ROWS) {
+      loaderPublish(ld, &batch, bytes_read);
+      last_publish = monotonicMs();
+    }
+  }
+  free(buf);
+  rowCarverDone(&rc);
+
+  loaderPublish(ld, &batch, bytes_read);
+  pthread_mutex_lock(&ld->lock);
+  ld->partial = ld->index->partial;
+  ld->error = err;
+  ld->done = 1;
+  pthread_mutex_unlock(&ld->lock);
+  return NULL;
+}
+
+// Viewer mode counterpart of loaderThread: count lines and record the
+// offset of every VIEWER_CHECKPOINT_LINES-th line, keeping no text.
+static void *loaderIndexThread(void *arg) {
+  struct loaderState *ld = arg;
+  if (ld->index->valid && VIEWER_CHECKPOINT_LINES % ld->index->stride == 0) {
+    // Any stored index whose stride divides ours already has every checkpoint
+    int step = VIEWER_CHECKPOINT_LINES / ld->index->stride;
+    pthread_mutex_lock(&ld->lock);
+    free(ld->checkpoints);
+    ld->checkpointcap = ld->index->noffsets / step + 1;
+    ld->checkpoints = malloc(sizeof(off_t) * ld->checkpointcap);
+    ld->ncheckpoints = 0;
+    for (long long i = 0; i < ld->index->noffsets; i += step)
+      ld->checkpoints[ld->ncheckpoints++] = ld->index->offsets[i];
+    ld->numlines = ld->index->numlines;
+    ld->partial = ld->index->partial;
+    ld->bytes_read = ld->index->st.st_size;
+    ld->done = 1;
+    pthread_mutex_unlock(&ld->lock);
+    return NULL;
+  }
+
+  char *buf = malloc(LOAD_CHUNK_SIZE);
+  long long bytes_read = 0;
+  long long lines = 0;
+  long long last_publish = monotonicMs();
+  int partial = 0; // bytes seen after the last newline
+  int err = 0;
+
+  while (1) {
+    ssize_t n = read(ld->fd, buf, LOAD_CHUNK_SIZE);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      err = errno;
+      break;
+    }
+    if (n == 0) break;
+
+    char *p = buf;
+    char *end = buf + n;
+    char *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+      lines++;
+      if (lines % VIEWER_CHECKPOINT_LINES == 0) {
+        pthread_mutex_lock(&ld->lock);
+        if (ld->ncheckpoints == ld->checkpointcap) {
+          ld->checkpointcap *= 2;
+          ld->checkpoints = realloc(ld->checkpoints, sizeof(off_t) * ld->checkpointcap);
+        }
+        ld->checkpoints[ld->ncheckpoints++] = bytes_read + (nl - buf) + 1;
+        pthread_mutex_unlock(&ld->lock);
+      }
+      p = nl + 1;
+    }
+    partial = p < end;
+    bytes_read += n;
+
+    if (monotonicMs() - last_publish >= LOAD_PUBLISH_MS) {
+      pthread_mutex_lock(&ld->lock);
+      ld->numlines = lines;
+      ld->bytes_read = bytes_read;
+      pthread_mutex_unlock(&ld->lock);
+      last_publish = monotonicMs();
+    }
+  }
+  free(buf);
+
+  // Only this thread writes the checkpoints, so no lock is needed to read them
+  if (ld->index->path && !err)
+    loaderWriteIndex(ld, ld->checkpoints, ld->ncheckpoints, VIEWER_CHECKPOINT_LINES,
+      lines + partial, partial);
+
+  pthread_mutex_lock(&ld->lock);
+  ld->numlines = lines + partial;
+  ld->partial = partial;
+  ld->bytes_read = bytes_read;
+  ld->error = err;
+  ld->done = 1;
+  pthread_mutex_unlock(&ld->lock);
+  return NULL;
+}
+
+// Start loading fd on the loader thread; rows show up in E.row (or, in
+// viewer mode, in the sparse index) as the main thread picks them up in
+// editorLoaderPoll().
+void editorLoaderStart(int fd, long long total_bytes) {
+  loader->fd = fd;
+  loader->head = loader->tail = NULL;
+  loader->bytes_read = 0;
+  loader->total_bytes = total_bytes;
+  loader->done = 0;
+  loader->error = 0;
+  loader->numlines = 0;
+  loader->checkpointcap = 1024;
+  loader->checkpoints = malloc(sizeof(off_t) * loader->checkpointcap);
+  loader->checkpoints[0] = 0;
+  loader->ncheckpoints = 1;
+  E.loading = 1;
+  void *(*fn)(void *) = loaderThread;
+  if (E.viewer) fn = loaderIndexThread;
+  else if (lineindex->valid && lineindex->stride == 1) fn = loaderSliceThread;
+  loader->index = lineindex;
+  if (pthread_create(&loader->thread, NULL, fn, loader) != 0) die("pthread_create");
+}
+
+static void viewerPublishIndex(void);
+
+// Append every published batch to E.row. Returns 1 if anything changed.
+int editorLoaderPoll(void) {
+  if (!E.loading) return 0;
+
+  pthread_mutex_lock(&loader->lock);
+  loadBatch *batch = loader->head;
+  loader->head = loader->tail = NULL;
+  int done = loader->done;
+  int err = loader->error;
+  pthread_mutex_unlock(&loader->lock);
+
+  int changed = batch != NULL;
+  if (E.viewer) {
+    viewerPublishIndex();
+    changed = 1;
+  }
+  while (batch) {
+    loadBatch *next = batch->next;
+    E.row = realloc(E.row, sizeof(erow) * (E.numrows + batch->numrows));
+    memcpy(&E.row[E.numrows], batch->rows, sizeof(erow) * batch->numrows);
+    for (int i = 0; i < batch->numrows; i++) {
+      editorDiffLoadedRow(E.numrows + i, batch->hashes[i]);
+      editorDiskLoadedRow(batch->hashes[i]);
+    }
+    E.numrows += batch->numrows;
+    free(batch->rows);
+    free(batch->hashes);
+    free(batch);
+    batch = next;
+  }
+
+  if (done) {
+    pthread_join(loader->thread, NULL);
+    close(loader->fd);
+    loader->fd = -1;
+    free(loader->checkpoints); // unless viewerPublishIndex() took them
+    loader->checkpoints = NULL;
+    E.loading = 0;
+    if (err) editorSetStatusMessage("Read error: %s", strerror(err));
+    else editorIndexRestorePosition();
+    changed = 1;
+  }
+  return changed;
+}
+
+// Progress of the running load as a percentage, or -1 if the total size
+// is unknown, in which case *bytes is set to what has been read so far.
+int editorLoaderProgress(long long *bytes) {
+  pthread_mutex_lock(&loader->lock);
+  long long done = loader->bytes_read;
+  long long total = loader->total_bytes;
+  pthread_mutex_unlock(&loader->lock);
+  *bytes = done;
+  if (total <= 0) return -1;
+  return (int)(done * 100 / total);
+}
+
+/*********** viewer   *****************/
+
+// Viewer mode opens files too big to hold in memory, read-only. The loader
+// thread records the offset of every VIEWER_CHECKPOINT_LINES-th line, and
+// rows are decoded on demand from the file a page (the lines between two
+// checkpoints) at a time through a small LRU cache. Memory stays at the
+// checkpoint table plus VIEWER_CACHE_BYTES of pages whatever the file size.
+
+#define VIEWER_CACHE_PAGES 32
+#define VIEWER_CACHE_BYTES (4 << 20)
+#define VIEWER_MAX_LINE 2048 // longer lines are cut off, so a page fits the cache
+#define VIEWER_READ_SIZE (64 * 1024)
+
+typedef struct viewerPage {
+  int page;      // -1 if the slot is free
+  int numrows;
+  erow *rows;    // chars point into data
+  char *data;
+  size_t bytes;  // of rows and data
+  unsigned long used;
+} viewerPage;
+
+struct viewerState {
+  int fd;
+  off_t *checkpoints;  // NULL while the loader still owns them
+  int ncheckpoints;
+  int checkpointcap;
+  viewerPage cache[VIEWER_CACHE_PAGES];
+  size_t cachebytes;
+  unsigned long clock;
+};
+
+static struct viewerState *viewer; // of the active buffer
+
+static void viewerStateInit(struct viewerState *v) {
+  *v = (struct viewerState){ .fd = -1 };
+}
+
+// Called from editorLoaderPoll(): pick up the line count published by
+// loaderIndexThread, and its checkpoints once it has finished with them.
+static void viewerPublishIndex(void) {
+  pthread_mutex_lock(&loader->lock);
+  viewer->ncheckpoints = loader->ncheckpoints;
+  if (loader->done && loader->checkpoints) {
+    viewer->checkpoints = loader->checkpoints;
+    viewer->checkpointcap = loader->checkpointcap;
+    loader->checkpoints = NULL;
+  }
+  long long lines = loader->numlines;
+  pthread_mutex_unlock(&loader->lock);
+  E.numrows = lines > INT_MAX - 1 ? INT_MAX - 1 : (int)lines;
+}
+
+// Offset of the first line of page; the loader may still be growing the
+// table, so until it hands it over it is read under the loader's lock.
+static off_t viewerCheckpoint(int page) {
+  if (viewer->checkpoints) return viewer->checkpoints[page];
+  pthread_mutex_lock(&loader->lock);
+  off_t off = loader->checkpoints[page];
+  pthread_mutex_unlock(&loader->lock);
+  return off;
+}
+
+static void viewerDecodePage(viewerPage *pg, int page) {
+  int first = page * VIEWER_CHECKPOINT_LINES;
+  int want = E.numrows - first;
+  if (want > VIEWER_CHECKPOINT_LINES) want = VIEWER_CHECKPOINT_LINES;
+  if (want < 0) want = 0;
+
+  struct abuf data = ABUF_INIT;
+  int *starts = malloc(sizeof(int) * (want + 1));
+  int *sizes = malloc(sizeof(int) * (want + 1));
+  int n = 0;
+  int linelen = 0;
+  char *buf = malloc(VIEWER_READ_SIZE);
+  off_t off = viewerCheckpoint(page);
+
+  starts[0] = 0;
+  while (n < want) {
+    ssize_t got = pread(viewer->fd, buf, VIEWER_READ_SIZE, off);
+    if (got <= 0) break;
+    off += got;
+    char *p = buf;
+    char *end = buf + got;
+    while (p < end && n < want) {
+      char *nl = memchr(p, '\n', end - p);
+      int take = (nl ? nl : end) - p;
+      if (linelen + take > VIEWER_MAX_LINE) take = VIEWER_MAX_LINE - linelen;
+      if (take > 0) abAppend(&data, p, take);
+      linelen += take;
+      if (!nl) break;
+
+      while (linelen > 0 && data.b[data.len - 1] == '\r') {
+        data.len--;
+        linelen--;
+      }
+      abAppend(&data, "", 1);
+      sizes[n++] = linelen;
+      starts[n] = data.len;
+      linelen = 0;
+      p = nl + 1;
+    }
+  }
+  // A last line without a trailing newline ends at EOF
+  if (n < want && linelen > 0) {
+    abAppend(&data, "", 1);
+    sizes[n++] = linelen;
+  }
+  free(buf);
+
+  pg->page = page;
+  pg->numrows = n;
+  pg->data = data.b;
+  pg->rows = malloc(sizeof(erow) * (n + 1));
+  pg->bytes = data.len + sizeof(erow) * (n + 1);
+  viewer->cachebytes += pg->bytes;
+  for (int i = 0; i < n; i++) {
+    pg->rows[i].size = sizes[i];
+    pg->rows[i].chars = data.b + starts[i];
+  }
+  free(starts);
+  free(sizes);
+}
+
+static void viewerFreePage(struct viewerState *v, viewerPage *c) {
+  if (c->page == -1) return;
+  free(c->rows);
+  free(c->data);
+  v->cachebytes -= c->bytes;
+  c->page = -1;
+  c->used = 0;
+}
+
+// Row `at` of a viewer-mode file. The pointer stays valid until a row of
+// another page is asked for.
+static erow *viewerRow(int at) {
+  static erow empty = {0, "", -1, 0, 0, 0};
+  int page = at / VIEWER_CHECKPOINT_LINES;
+  int idx = at - page * VIEWER_CHECKPOINT_LINES;
+  if (page >= viewer->ncheckpoints) return &empty;
+
+  viewerPage *pg = NULL;
+  viewerPage *victim = &viewer->cache[0];
+  for (int i = 0; i < VIEWER_CACHE_PAGES; i++) {
+    viewerPage *c = &viewer->cache[i];
+    if (c->page == page) {
+      pg = c;
+      break;
+    }
+    if (c->used < victim->used) victim = c;
+  }
+  // A page decoded while the index was still growing may be short
+  if (pg && idx >= pg->numrows) victim = pg;
+  if (!pg || victim == pg) {
+    pg = victim;
+    viewerFreePage(viewer, pg);
+    viewerDecodePage(pg, page);
+    // Make room by dropping the least recently used of the others
+    while (viewer->cachebytes > VIEWER_CACHE_BYTES) {
+      viewerPage *lru = NULL;
+      for (int i = 0; i < VIEWER_CACHE_PAGES; i++) {
+        viewerPage *c = &viewer->cache[i];
+        if (c != pg && c->page != -1 && (!lru || c->used < lru->used)) lru = c;
+      }
+      if (!lru) break;
+      viewerFreePage(viewer, lru);
+    }
+  }
+  pg->used = ++viewer->clock;
+
+  return idx < pg->numrows ? &pg->rows[idx] : &empty;
+}
+
+// Forget the cached page holding row `at`, whose contents have changed.
+static void viewerInvalidate(int at) {
+  int page = at / VIEWER_CHECKPOINT_LINES;
+  for (int i = 0; i < VIEWER_CACHE_PAGES; i++) {
+    if (viewer->cache[i].page == page) viewerFreePage(viewer, &viewer->cache[i]);
+  }
+}
+
+// Free every decoded page; they are decoded again when needed.
+static void viewerDropCache(struct viewerState *v) {
+  for (int i = 0; i < VIEWER_CACHE_PAGES; i++) viewerFreePage(v, &v->cache[i]);
+}
+
+void editorViewerInit(int fd) {
+  viewer->fd = dup(fd);
+  if (viewer->fd == -1) die("dup");
+  viewer->checkpoints = NULL;
+  viewer->ncheckpoints = 0;
+  viewer->checkpointcap = 0;
+  viewer->cachebytes = 0;
+  for (int i = 0; i < VIEWER_CACHE_PAGES; i++) {
+    viewer->cache[i].page = -1;
+    viewer->cache[i].used = 0;
+  }
+}
+
+// Files bigger than half the machine's memory open in viewer mode even
+// without -R.
+static long long viewerAutoThreshold(void) {
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long pagesize = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || pagesize <= 0) return 1LL << 32;
+  return (long long)pages * pagesize / 2;
+}
+
+/*********** follow   *****************/
+
+// Follow mode (tail -f): an inotify watch on the file wakes us up, and
+// only the bytes past what has been read so far are pulled in and
+// appended as rows. Existing rows are never touched, except that the
+// last row grows if it had no trailing newline yet.
+
+#define FOLLOW_READ_SIZE (1 << 20)
+
+struct followState {
+  int ifd;          // inotify instance, -1 when not following
+  int wd;
+  int started;      // offset has been taken over from the loader
+  off_t offset;     // bytes of the file consumed so far
+  int partial;      // the last row has not seen its newline yet
+  long long lines;  // completed lines, used to extend the viewer index
+};
+
+static struct followState *follow; // of the active buffer
+
+static void followStateInit(struct followState *f) {
+  *f = (struct followState){ .ifd = -1 };
+}
+
+void editorFollowStart(void) {
+  if (E.filename == NULL) {
+    editorSetStatusMessage("Follow mode needs a file name");
+    return;
+  }
+  follow->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (follow->ifd == -1) {
+    editorSetStatusMessage("Can't follow: %s", strerror(errno));
+    return;
+  }
+  follow->wd = inotify_add_watch(follow->ifd, E.filename, IN_MODIFY);
+  if (follow->wd == -1) {
+    editorSetStatusMessage("Can't follow: %s", strerror(errno));
+    close(follow->ifd);
+    follow->ifd = -1;
+    return;
+  }
+  E.follow = 1;
+}
+
+void editorFollowStop(void) {
+  if (follow->ifd != -1) close(follow->ifd);
+  follow->ifd = -1;
+  E.follow = 0;
+}
+
+// The file now holds the buffer's rows, each ended by a newline, so
+// follow on from its end rather than read the save back as new lines.
+void editorFollowSaved(off_t size) {
+  follow->started = 1;
+  follow->offset = size;
+  follow->partial = 0;
+  follow->lines = E.numrows;
+}
+
+// Append the rows in buf[0..len) to the buffer, continuing the last row
+// if it was left partial.
+static void followAppendRows(const char *buf, size_t len) {
+  const char *p = buf;
+  const char *end = buf + len;
+
+  // At most one row per newline plus the unterminated tail
+  size_t newrows = 1;
+  for (const char *q = buf; (q = memchr(q, '\n', end - q)) != NULL; q++) newrows++;
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + newrows));
+
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t seglen = (nl ? nl : end) - p;
+    size_t keep = seglen;
+    if (nl) {
+      while (keep > 0 && p[keep - 1] == '\r') keep--;
+    }
+
+    if (follow->partial && E.numrows > 0) {
+      erow *row = &E.row[E.numrows - 1];
+      editorWordsEditBegin(row, row->size, 0);
+      row->chars = rowResize(row->chars, row->size, row->size + keep);
+      memcpy(&row->chars[row->size], p, keep);
+      row->size += keep;
+      row->chars[row->size] = '\0';
+      editorWordsEditEnd(row);
+      editorDiffLoadedRowGrew(E.numrows - 1);
+      editorViewsDamage(E.numrows - 1, E.numrows - 1);
+      editorDiskLoadedRowGrew(editorHashLine(row->chars, row->size));
+      E.edits++; // an existing row changed, so drop any pending undo
+    } else {
+      erow *row = &E.row[E.numrows++];
+      row->size = keep;
+      row->chars = rowAlloc(keep);
+      memcpy(row->chars, p, keep);
+      row->chars[keep] = '\0';
+      editorWordsCountRow(row, 1);
+      unsigned long long hash = editorHashLine(row->chars, row->size);
+      editorDiffLoadedRow(E.numrows - 1, hash);
+      editorDiskLoadedRow(hash);
+    }
+    follow->partial = nl == NULL;
+    p = nl ? nl + 1 : end;
+  }
+}
+
+// Viewer mode keeps no rows, only the index: count the new lines, record
+// checkpoints as they are crossed, and drop the cached last page.
+static void followExtendIndex(const char *buf, size_t len, off_t base) {
+  const char *p = buf;
+  const char *end = buf + len;
+  const char *nl;
+  int old_last = E.numrows - 1;
+  while ((nl = memchr(p, '\n', end - p)) != NULL) {
+    follow->lines++;
+    if (follow->lines % VIEWER_CHECKPOINT_LINES == 0) {
+      if (viewer->ncheckpoints == viewer->checkpointcap) {
+        viewer->checkpointcap = viewer->checkpointcap ? viewer->checkpointcap * 2 : 1024;
+        viewer->checkpoints = realloc(viewer->checkpoints, sizeof(off_t) * viewer->checkpointcap);
+      }
+      viewer->checkpoints[viewer->ncheckpoints++] = base + (nl - buf) + 1;
+    }
+    p = nl + 1;
+  }
+  follow->partial = p < end;
+  E.numrows = follow->lines + follow->partial;
+  if (old_last >= 0) {
+    viewerInvalidate(old_last);
+    editorViewsDamage(old_last, old_last);
+  }
+}
+
+// Returns 1 if the screen needs to be redrawn, which is only the case when
+// the user is looking at the end of the file.
+int editorFollowPoll(void) {
+  if (!E.follow || E.loading) return 0;
+
+  if (!follow->started) {
+    pthread_mutex_lock(&loader->lock);
+    follow->offset = loader->bytes_read;
+    follow->partial = loader->partial;
+    follow->lines = loader->numlines - loader->partial;
+    pthread_mutex_unlock(&loader->lock);
+    follow->started = 1;
+  }
+
+  char evbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int woke = 0;
+  while (read(follow->ifd, evbuf, sizeof(evbuf)) > 0) woke = 1;
+  if (!woke) return 0;
+
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == follow->offset) {
+    close(fd);
+    return 0;
+  }
+  if (st.st_size < follow->offset) {
+    close(fd);
+    editorSetStatusMessage("File truncated, stopped following");
+    editorFollowStop();
+    return 1;
+  }
+
+  int at_end = E.rowoff + E.screenrows >= E.numrows; // last row is on screen
+  int pinned = E.cy >= E.numrows - 1;              // cursor sits on the last row
+  char *buf = malloc(FOLLOW_READ_SIZE);
+  while (follow->offset < st.st_size) {
+    ssize_t n = pread(fd, buf, FOLLOW_READ_SIZE, follow->offset);
+    if (n <= 0) break;
+    if (E.viewer) followExtendIndex(buf, n, follow->offset);
+    else followAppendRows(buf, n);
+    follow->offset += n;
+  }
+  free(buf);
+  close(fd);
+  editorDiskFollowed(&st);
+
+  if (!at_end) return 0;
+  if (pinned) {
+    E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+    E.cx = 0;
+  }
+  return 1;
+}
+
+/*********** rows   *****************/
+
+// Read access to rows goes through here so viewer mode can supply them
+// from the file. Only edit operations index E.row directly.
+erow *editorRow(int at) {
+  if (E.viewer) return viewerRow(at);
+  return &E.row[at];
+}
+
+/*********** views   *****************/
+
+// The screen is tiled into views of the active buffer, each with its own
+// cursor, scroll offsets and selection and a status bar along its bottom
+// edge. The focused view keeps these in E, where the rest of the editor
+// expects them; the others are parked in their editorView and brought
+// into E only to be drawn. Edits mark the buffer rows they touch as
+// damaged, and a redraw rewrites only the damaged rows each view shows,
+// unless what the view shows has moved (scrolling, line number width,
+// search highlight), which repaints that view whole.
+
+#define VIEW_MIN_ROWS 2  // a line of text and the status bar
+#define VIEW_MIN_COLS 20
+
+typedef struct editorView {
+  int top, left, rows, cols;  // on screen, status bar included
+  int cx, cy, rowoff, coloff; // while not focused
+  int sel_start_x, sel_start_y, selecting, block;
+  editorCursor *cursors;
+  int ncursors;
+  // What the last redraw left on the screen
+  int drawn;                  // 0 if none of it can be kept
+  int drawn_rowoff, drawn_coloff, drawn_numrows, drawn_width;
+  int drawn_sel[5];           // start y, x, end y, x and whether a block; start y is -1 if none
+  char *drawn_query;
+} editorView;
+
+struct viewsState {
+  editorView *list;
+  int num;
+  int cur;
+  int lo, hi; // buffer rows damaged since the last redraw
+};
+
+static struct viewsState *views; // of the active buffer
+
+static void viewsStateInit(struct viewsState *vs) {
+  *vs = (struct viewsState){ .num = 1, .lo = INT_MAX, .hi = -1 };
+  vs->list = malloc(sizeof(editorView));
+  vs->list[0] = (editorView){ .rows = E.termrows - 1, .cols = E.termcols,
+                              .sel_start_x = -1, .sel_start_y = -1 };
+}
+
+// The text area of v, short of the separator column unless v reaches the
+// right edge of the terminal, is what E's screen size describes.
+static void viewSize(const editorView *v) {
+  E.screenrows = v->rows - 1;
+  E.screencols = v->cols - (v->left + v->cols < E.termcols);
+}
+
+static void viewPark(editorView *v) {
+  v->cx = E.cx;
+  v->cy = E.cy;
+  v->rowoff = E.rowoff;
+  v->coloff = E.coloff;
+  v->sel_start_x = E.sel_start_x;
+  v->sel_start_y = E.sel_start_y;
+  v->selecting = E.selecting;
+  v->block = E.block;
+  v->cursors = E.cursors;
+  v->ncursors = E.ncursors;
+}
+
+static void viewEnter(const editorView *v) {
+  E.cx = v->cx;
+  E.cy = v->cy;
+  E.rowoff = v->rowoff;
+  E.coloff = v->coloff;
+  E.sel_start_x = v->sel_start_x;
+  E.sel_start_y = v->sel_start_y;
+  E.selecting = v->selecting;
+  E.block = v->block;
+  E.cursors = v->cursors;
+  E.ncursors = v->ncursors;
+  viewSize(v);
+}
+
+void editorViewsInvalidate(void) {
+  for (int i = 0; i < views->num; i++) views->list[i].drawn = 0;
+}
+
+void editorViewsDamage(int lo, int hi) {
+  if (lo < views->lo) views->lo = lo;
+  if (hi > views->hi) views->hi = hi;
+}
+
+// Extra cursors below a row inserted at `at` move down with their text;
+// those on a deleted row go with it.
+static void cursorsShift(editorCursor *c, int *n, int at, int delta) {
+  if (*n == 0) return;
+  int i = 0;
+  while (i < *n && c[i].y < at) i++;
+  if (delta < 0) {
+    int j = i;
+    while (j < *n && c[j].y == at) j++;
+    memmove(&c[i], &c[j], sizeof(editorCursor) * (*n - j));
+    *n -= j - i;
+  }
+  for (; i < *n; i++) {
+    if (delta > 0 || c[i].y > at) c[i].y += delta;
+  }
+}
+
+// A row was inserted at `at`; what the other views show below it moves
+// down with it.
+void editorViewsRowInserted(int at) {
+  editorViewsDamage(at, INT_MAX);
+  cursorsShift(E.cursors, &E.ncursors, at, 1);
+  for (int i = 0; i < views->num; i++) {
+    editorView *v = &views->list[i];
+    if (i == views->cur) continue;
+    if (v->cy >= at) v->cy++;
+    if (v->rowoff > at) v->rowoff++;
+    if (v->sel_start_y >= at) v->sel_start_y++;
+    cursorsShift(v->cursors, &v->ncursors, at, 1);
+  }
+}
+
+void editorViewsRowDeleted(int at) {
+  editorViewsDamage(at, INT_MAX);
+  cursorsShift(E.cursors, &E.ncursors, at, -1);
+  for (int i = 0; i < views->num; i++) {
+    editorView *v = &views->list[i];
+    if (i == views->cur) continue;
+    if (v->cy > at) v->cy--;
+    if (v->rowoff > at) v->rowoff--;
+    if (v->sel_start_y > at) v->sel_start_y--;
+    cursorsShift(v->cursors, &v->ncursors, at, -1);
+  }
+}
+
+static void viewRangeAdd(int *lo, int *hi, int a, int b) {
+  if (a > b) {
+    int t = a;
+    a = b;
+    b = t;
+  }
+  if (a < *lo) *lo = a;
+  if (b > *hi) *hi = b;
+}
+
+// Decide what of v, brought into E, a redraw has to rewrite on top of
+// the damaged buffer rows. Returns 1 for all of it; otherwise widens
+// [*lo, *hi] by the rows that came or went and those whose part in the
+// selection sel (as in drawn_sel) changed.
+static int viewDamage(const editorView *v, const int *sel, int *lo, int *hi) {
+  const char *q = E.highlight_query;
+  if (!v->drawn || v->drawn_rowoff != E.rowoff || v->drawn_coloff != E.coloff ||
+      v->drawn_width != editorLineNumberWidth() ||
+      (q == NULL) != (v->drawn_query == NULL) || (q && strcmp(q, v->drawn_query) != 0)) {
+    return 1;
+  }
+  if (v->drawn_numrows != E.numrows) {
+    viewRangeAdd(lo, hi, v->drawn_numrows < E.numrows ? v->drawn_numrows : E.numrows, INT_MAX);
+  }
+  const int *d = v->drawn_sel;
+  if (memcmp(d, sel, sizeof(v->drawn_sel)) != 0) {
+    if (d[0] == -1 || sel[0] == -1) {
+      const int *s = d[0] == -1 ? sel : d;
+      viewRangeAdd(lo, hi, s[0], s[2]);
+    } else if (d[4] != sel[4] || (sel[4] && (d[1] != sel[1] || d[3] != sel[3]))) {
+      // A block that got wider or narrower changes on every row
+      viewRangeAdd(lo, hi, d[0], d[2]);
+      viewRangeAdd(lo, hi, sel[0], sel[2]);
+    } else {
+      // Only the rows between where an end was and where it is now
+      if (d[0] != sel[0] || d[1] != sel[1]) viewRangeAdd(lo, hi, d[0], sel[0]);
+      if (d[2] != sel[2] || d[3] != sel[3]) viewRangeAdd(lo, hi, d[2], sel[2]);
+    }
+  }
+  return 0;
+}
+
+static void viewDrawn(editorView *v, const int *sel) {
+  v->drawn = 1;
+  v->drawn_rowoff = E.rowoff;
+  v->drawn_coloff = E.coloff;
+  v->drawn_numrows = E.numrows;
+  v->drawn_width = editorLineNumberWidth();
+  memcpy(v->drawn_sel, sel, sizeof(v->drawn_sel));
+  const char *q = E.highlight_query;
+  if (q == NULL || v->drawn_query == NULL || strcmp(q, v->drawn_query) != 0) {
+    free(v->drawn_query);
+    v->drawn_query = q ? strdup(q) : NULL;
+  }
+}
+
+// Make parked view i the focused one. Edits made from other views may
+// have pulled the text from under its cursor.
+static void viewFocus(int i) {
+  views->cur = i;
+  viewEnter(&views->list[i]);
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  int len = E.cy < E.numrows ? editorRow(E.cy)->size : 0;
+  if (E.cx > len) E.cx = len;
+}
+
+void editorViewFocus(int i) {
+  if (i < 0 || i >= views->num || i == views->cur) return;
+  viewPark(&views->list[views->cur]);
+  viewFocus(i);
+}
+
+void editorViewNext(void) {
+  editorViewFocus((views->cur + 1) % views->num);
+}
+
+// Split the focused view in two, stacked or side by side; the new half
+// (below or right) starts out as a copy and gets the focus.
+void editorViewSplit(int side_by_side) {
+  editorView *c = &views->list[views->cur];
+  if (side_by_side ? c->cols < 2 * VIEW_MIN_COLS : c->rows < 2 * VIEW_MIN_ROWS) {
+    editorSetStatusMessage("No room to split this view");
+    return;
+  }
+  viewPark(c);
+  editorView n = *c;
+  n.drawn_query = NULL;
+  n.cursors = NULL; // the extra cursors stay with the view they were put in
+  n.ncursors = 0;
+  if (side_by_side) {
+    c->cols -= c->cols / 2;
+    n.left = c->left + c->cols;
+    n.cols -= c->cols;
+  } else {
+    c->rows -= c->rows / 2;
+    n.top = c->top + c->rows;
+    n.rows -= c->rows;
+  }
+
+  int at = views->cur + 1;
+  views->list = realloc(views->list, sizeof(editorView) * (views->num + 1));
+  memmove(&views->list[at + 1], &views->list[at], sizeof(editorView) * (views->num - at));
+  views->list[at] = n;
+  views->num++;
+  views->cur = at;
+  viewSize(&views->list[at]);
+  editorViewsInvalidate();
+}
+
+// The views along one side of c (0 above, 1 below, 2 left, 3 right) can
+// take over its rectangle if together they line up with that whole edge.
+// Returns one of them, or -1 if they can't; with grow set, they do.
+static int viewNeighbours(const editorView *c, int side, int grow) {
+  int clo = side < 2 ? c->left : c->top;
+  int chi = clo + (side < 2 ? c->cols : c->rows);
+  int first = -1;
+  int covered = 0;
+  for (int i = 0; i < views->num; i++) {
+    editorView *v = &views->list[i];
+    if (v == c) continue;
+    int touches = side == 0 ? v->top + v->rows == c->top :
+                  side == 1 ? v->top == c->top + c->rows :
+                  side == 2 ? v->left + v->cols == c->left :
+                              v->left == c->left + c->cols;
+    int lo = side < 2 ? v->left : v->top;
+    int hi = lo + (side < 2 ? v->cols : v->rows);
+    if (!touches || hi <= clo || lo >= chi) continue;
+    if (lo < clo || hi > chi) return -1; // reaches past the edge
+    covered += hi - lo;
+    if (first == -1) first = i;
+    if (!grow) continue;
+    if (side == 0) {
+      v->rows += c->rows;
+    } else if (side == 1) {
+      v->top = c->top;
+      v->rows += c->rows;
+    } else if (side == 2) {
+      v->cols += c->cols;
+    } else {
+      v->left = c->left;
+      v->cols += c->cols;
+    }
+  }
+  return covered == chi - clo ? first : -1;
+}
+
+// Close the focused view, handing its rectangle to the views next to it.
+// Splitting only ever halves a view, so some side always lines up.
+void editorViewClose(void) {
+  if (views->num == 1) {
+    editorSetStatusMessage("Can't close the only view");
+    return;
+  }
+  editorView *c = &views->list[views->cur];
+  int side = 0;
+  while (side < 4 && viewNeighbours(c, side, 0) == -1) side++;
+  if (side == 4) return;
+  int into = viewNeighbours(c, side, 1);
+
+  free(c->drawn_query);
+  free(E.cursors);
+  int gone = views->cur;
+  memmove(&views->list[gone], &views->list[gone + 1], sizeof(editorView) * (views->num - gone - 1));
+  views->num--;
+  if (into > gone) into--;
+  viewFocus(into); // the closed view's cursor, still in E, is dropped
+  editorViewsInvalidate();
+}
+
+/*********** output   *****************/
+
+void editorSetStatusMessage(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+  va_end(ap);
+  E.statusmsg_time = time(NULL);
+}
+
+void editorScroll(void) {
+  if (E.cy < E.rowoff) {
+    E.rowoff = E.cy;
+  }
+  if (E.cy >= E.rowoff + E.screenrows) {
+    E.rowoff = E.cy - E.screenrows + 1;
+  }
   
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
+  int available_width = E.screencols - editorLineNumberWidth();
+  if (E.cx < E.coloff) {
+    E.coloff = E.cx;
+  }
+  if (E.cx >= E.coloff + available_width) {
+    E.coloff = E.cx - available_width + 1;
+  }
+}
+
+// Draw view v, brought into E, leaving alone the lines still on screen
+// from the last redraw.
+void editorDrawRows(struct abuf *ab, editorView *v) {
+  int y;
+  int line_num_width = editorLineNumberWidth();
+
+  // Determine the selection start and end points, regardless of cursor direction
+  int start_y = 0, start_x = 0, end_y = 0, end_x = 0;
+  int selection_is_active = E.selecting;
+  if (selection_is_active) {
+    if (E.sel_start_y < E.cy || (E.sel_start_y == E.cy && E.sel_start_x <= E.cx)) {
+      start_y = E.sel_start_y;
+      start_x = E.sel_start_x;
+      end_y = E.cy;
+      end_x = E.cx;
+    } else {
+      start_y = E.cy;
+      start_x = E.cx;
+      end_y = E.sel_start_y;
+      end_x = E.sel_start_x;
+    }
+  }
+
+  // A block spans the same columns on each of its rows
+  if (selection_is_active && E.block) {
+    start_x = E.sel_start_x < E.cx ? E.sel_start_x : E.cx;
+    end_x = E.sel_start_x < E.cx ? E.cx : E.sel_start_x;
+  }
+  int sel[5] = { -1, 0, 0, 0, 0 };
+  if (selection_is_active) {
+    sel[0] = start_y;
+    sel[1] = start_x;
+    sel[2] = end_y;
+    sel[3] = end_x;
+    sel[4] = E.block;
+  }
+  int lo = INT_MAX, hi = -1;
+  int full = viewDamage(v, sel, &lo, &hi);
+  int separator = E.screencols < v->cols;
+  int ci = editorCursorsFrom(E.rowoff);
+
+  for (y = 0; y < E.screenrows; y++) {
+    int filerow = y + E.rowoff;
+    while (ci < E.ncursors && E.cursors[ci].y < filerow) ci++;
+    if (!full && !(filerow >= views->lo && filerow <= views->hi) &&
+        !(filerow >= lo && filerow <= hi)) {
+      continue;
+    }
+    char pos[32];
+    snprintf(pos, sizeof(pos), "\x1b[%d;%dH", v->top + y + 1, v->left + 1);
+    abAppend(ab, pos, strlen(pos));
+    int width = line_num_width; // columns written
+
+    // Draw diff marker and line number
+    if (E.gutter) {
+      const char *marker = editorDiffMarker(filerow);
+      abAppend(ab, marker, strlen(marker));
+    }
+    int num_width = line_num_width - E.gutter;
+    char line_num[16];
+    if (filerow >= E.numrows) {
+      snprintf(line_num, sizeof(line_num), "%*s", num_width, "~");
+    } else {
+      snprintf(line_num, sizeof(line_num), "%*d ", num_width - 1, filerow + 1);
+    }
+    abAppend(ab, line_num, num_width);
+    
+    if (filerow >= E.numrows) {
+      if (E.numrows == 0 && y == E.screenrows / 3) {
+        char welcome[80];
+        int welcomelen = snprintf(welcome, sizeof(welcome), "Cilo editor -- version 0.0.1");
+        int available_width = E.screencols - line_num_width;
+        if (welcomelen > available_width) welcomelen = available_width;
+        int padding = (available_width - welcomelen) / 2;
+        width += padding + welcomelen;
+        while (padding--) abAppend(ab, " ", 1);
+        abAppend(ab, welcome, welcomelen);
+      }
+    } else {
+      erow *row = editorRow(filerow);
+      int available_width = E.screencols - line_num_width;
+      
+      // Highlighting Logic
+      int is_row_selected = selection_is_active && (filerow >= start_y && filerow <= end_y);
+      int sel_start_col = is_row_selected ? (E.block || filerow == start_y ? start_x : 0) : -1;
+      int sel_end_col = is_row_selected ? (E.block || filerow == end_y ? end_x : row->size) : -1;
+      
+      // Selection highlighting overrides search highlighting
+      char *highlight_search = E.highlight_query;
+      if (is_row_selected) {
+        highlight_search = NULL;
+      }
+      
+      int visible_len = row->size - E.coloff;
+      if (visible_len < 0) visible_len = 0;
+      if (visible_len > available_width) visible_len = available_width;
+      char *visible_start = row->chars + E.coloff;
+      width += visible_len;
+
+      if (!is_row_selected && !highlight_search) {
+        abAppend(ab, visible_start, visible_len);
+      } else {
+        // Find intersection of visible area and selection area
+        int vis_sel_start = sel_start_col != -1 ? (E.coloff > sel_start_col ? E.coloff : sel_start_col) : -1;
+        int vis_sel_end = sel_end_col != -1 ? ((E.coloff + visible_len) < sel_end_col ? (E.coloff + visible_len) : sel_end_col) : -1;
+
+        if (is_row_selected && vis_sel_start < vis_sel_end) {
+          // Draw with selection highlighting
+          int pre_len = vis_sel_start - E.coloff;
+          if (pre_len > 0) abAppend(ab, visible_start, pre_len);
+          
+          abAppend(ab, "\x1b[7m", 4);
+          abAppend(ab, row->chars + vis_sel_start, vis_sel_end - vis_sel_start);
+          abAppend(ab, "\x1b[m", 3);
+
+          int post_start_offset = vis_sel_end - E.coloff;
+          int post_len = visible_len - post_start_offset;
+          if (post_len > 0) abAppend(ab, visible_start + post_start_offset, post_len);
+        } else if (highlight_search) {
+          // Draw with search highlighting
+            char *current = visible_start;
+            int query_len = strlen(highlight_search);
+            char *end_of_visible = visible_start + visible_len;
+            
+            while(current < end_of_visible) {
+                char *match = strcasestr_impl(current, highlight_search);
+                if (match && match < end_of_visible) {
+                    abAppend(ab, current, match - current);
+                    abAppend(ab, "\x1b[7m", 4);
+                    int match_len = (match + query_len > end_of_visible) ? (end_of_visible - match) : query_len;
+                    abAppend(ab, match, match_len);
+                    abAppend(ab, "\x1b[m", 3);
+                    current = match + query_len;
+                } else {
+                    abAppend(ab, current, end_of_visible - current);
+                    break;
+                }
+            }
+        } else {
+            abAppend(ab, visible_start, visible_len);
+        }
+      }
+    }
+    
+    if (separator) {
+      // Blank the rest of the line up to the view to the right
+      if (width < E.screencols) {
+        snprintf(pos, sizeof(pos), "\x1b[%dX", E.screencols - width);
+        abAppend(ab, pos, strlen(pos));
+      }
+      snprintf(pos, sizeof(pos), "\x1b[%dG|", v->left + E.screencols + 1);
+      abAppend(ab, pos, strlen(pos));
+    } else {
+      abAppend(ab, "\x1b[K", 3);
+    }
+
+    // The other cursors, over what was just drawn
+    for (; ci < E.ncursors && E.cursors[ci].y == filerow; ci++) {
+      int x = E.cursors[ci].x;
+      if (x < E.coloff || x - E.coloff >= E.screencols - line_num_width) continue;
+      erow *row = filerow < E.numrows ? editorRow(filerow) : NULL;
+      char ch = row && x < row->size ? row->chars[x] : ' ';
+      snprintf(pos, sizeof(pos), "\x1b[%dG\x1b[7m%c\x1b[m",
+               v->left + line_num_width + x - E.coloff + 1, ch);
+      abAppend(ab, pos, strlen(pos));
+    }
+  }
+  viewDrawn(v, sel);
+}
+
+void editorDrawStatusBar(struct abuf *ab, const editorView *v) {
+  char pos[32];
+  snprintf(pos, sizeof(pos), "\x1b[%d;%dH", v->top + v->rows, v->left + 1);
+  abAppend(ab, pos, strlen(pos));
+  abAppend(ab, "\x1b[7m", 4);
+  char status[80], rstatus[80];
+  char progress[32] = "";
+  if (E.loading) {
+    long long bytes;
+    int pct = editorLoaderProgress(&bytes);
+    if (pct >= 0) snprintf(progress, sizeof(progress), " [loading %d%%]", pct);
+    else snprintf(progress, sizeof(progress), " [loading %.1f MB]", bytes / 1048576.0);
+  }
+  char bufinfo[32] = "";
+  int nbuffers;
+  int cur = editorBufferIndex(&nbuffers);
+  if (nbuffers > 1) snprintf(bufinfo, sizeof(bufinfo), "[%d/%d] ", cur + 1, nbuffers);
+  int len = snprintf(status, sizeof(status), "%s%.20s - %d lines%s%s%s", bufinfo,
+    E.filename ? E.filename : "[No Name]", E.numrows,
+    E.viewer ? " [view]" : "", E.follow ? " [follow]" : "", progress);
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
+    E.cy + 1, E.numrows);
+  if (len > E.screencols) len = E.screencols;
+  abAppend(ab, status, len);
+  while (len < E.screencols) {
+    if (E.screencols - len == rlen) {
+      abAppend(ab, rstatus, rlen);
+      break;
+    } else {
+      abAppend(ab, " ", 1);
+      len++;
+    }
+  }
+  abAppend(ab, "\x1b[m", 3);
+  if (E.screencols < v->cols) abAppend(ab, "|", 1);
+}
+
+void editorDrawMessageBar(struct abuf *ab) {
+  char pos[32];
+  snprintf(pos, sizeof(pos), "\x1b[%d;1H\x1b[K", E.termrows);
+  abAppend(ab, pos, strlen(pos));
+  int msglen = strlen(E.statusmsg);
+  if (msglen > E.termcols) msglen = E.termcols;
+  if (msglen && time(NULL) - E.statusmsg_time < 5)
+    abAppend(ab, E.statusmsg, msglen);
+}
+
+void editorRefreshScreen(void) {
+  struct abuf ab = ABUF_INIT;
+
+  abAppend(&ab, "\x1b[?25l", 6);
+
+  viewPark(&views->list[views->cur]);
+  for (int i = 0; i < views->num; i++) {
+    editorView *v = &views->list[i];
+    viewEnter(v);
+    editorScroll();
+    editorDrawRows(&ab, v);
+    editorDrawStatusBar(&ab, v);
+    viewPark(v);
+  }
+  editorView *v = &views->list[views->cur];
+  viewEnter(v);
+  views->lo = INT_MAX;
+  views->hi = -1;
+  editorDrawMessageBar(&ab);
+
+  char buf[32];
+  int line_num_width = editorLineNumberWidth();
+  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", v->top + (E.cy - E.rowoff) + 1,
+           v->left + (E.cx - E.coloff) + line_num_width + 1);
+  abAppend(&ab, buf, strlen(buf));
+
+  abAppend(&ab, "\x1b[?25h", 6);
+
+  write(STDOUT_FILENO, ab.b, ab.len);
+  abFree(&ab);
+}
+
+/*********** file i/o *****************/
+
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    totlen += E.row[j].size + 1;
+  }
+  *buflen = totlen;
+  char *buf = malloc(totlen);
+  char *p = buf;
+  for (j = 0; j < E.numrows; j++) {
+    memcpy(p, E.row[j].chars, E.row[j].size);
+    p += E.row[j].size;
+    *p = '\n';
+    p++;
+  }
+  return buf;
+}
+
+// Returns -1 with errno set if the file can't be opened, leaving the
+// buffer empty under its name so a save creates it.
+int editorOpen(char *filename) {
+  free(E.filename);
+  E.filename = NULL;
+
+  int fd;
+  long long total = -1;
+  struct stat st;
+  if (strcmp(filename, "-") == 0) {
+    // Read the pipe on the loader thread and take keys from the terminal
+    fd = dup(STDIN_FILENO);
+    if (fd == -1) die("dup");
+    int tty = open("/dev/tty", O_RDWR);
+    if (tty == -1) die("open /dev/tty");
+    if (dup2(tty, STDIN_FILENO) == -1) die("dup2");
+    close(tty);
+  } else {
+    E.filename = strdup(filename);
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      total = st.st_size;
+      editorIndexOpen(filename, &st);
+    }
+  }
+
+  // Viewer mode needs to seek back into the file, so not for pipes
+  if (total < 0) E.viewer = 0;
+  else if (total > viewerAutoThreshold()) E.viewer = 1;
+  if (E.viewer) editorViewerInit(fd);
+  else if (total >= 0) editorDiskOpened(&st);
+
+  editorLoaderStart(fd, total);
+  return 0;
+}
+
+void editorSave(void) {
+  if (E.filename == NULL) return;
+  if (E.loading) {
+    editorSetStatusMessage("Can't save while the file is still loading");
+    return;
+  }
+  if (editorDiskBeforeSave() == -1) return;
+  int len;
+  char *buf = editorRowsToString(&len);
+  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  if (fd != -1) {
+    if (ftruncate(fd, len) != -1) {
+      if (write(fd, buf, len) == len) {
+        close(fd);
+        free(buf);
+        editorJournalReset();
+        editorDiffSaved();
+        editorIndexSaved();
+        editorDiskSaved();
+        editorFollowSaved(len);
+        editorSetStatusMessage("%d bytes written to disk", len);
+        return;
+      }
+    }
+    close(fd);
+  }
+  free(buf);
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*********** editor operations *****************/
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numrows) return;
+  
+  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+  
+  E.row[at].size = len;
+  E.row[at].chars = rowAlloc(len);
+  memcpy(E.row[at].chars, s, len);
   E.row[at].chars[len] = '\0';
   E.numrows++;
+  E.edits++;
+  editorJournalRecord(J_INSERT_ROW, at, 0, s, len);
+  editorWordsCountRow(&E.row[at], 1);
+  editorDiffRowInserted(at);
+  editorViewsRowInserted(at);
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorWordsEditBegin(row, at, 0);
+  row->chars = rowResize(row->chars, row->size, row->size + 1);
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editorWordsEditEnd(row);
+  E.edits++;
+  char ch = c;
+  editorJournalRecord(J_INSERT_CHAR, row - E.row, at, &ch, 1);
+  editorDiffRowChanged(row - E.row);
+  editorViewsDamage(row - E.row, row - E.row);
+}
+
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+}
+
+void editorRowDelRange(erow *row, int at, int len) {
+  if (at < 0 || at >= row->size) return;
+  if (len > row->size - at) len = row->size - at;
+  editorWordsEditBegin(row, at, len);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editorWordsEditEnd(row);
+  E.edits++;
+  editorJournalRecord(J_DELETE, row - E.row, at, NULL, len);
+  editorDiffRowChanged(row - E.row);
+  editorViewsDamage(row - E.row, row - E.row);
+}
+
+void editorRowDelChar(erow *row, int at) {
+  editorRowDelRange(row, at, 1);
+}
+
+void editorRowTruncate(erow *row, int len) {
+  if (len < 0 || len >= row->size) return;
+  editorWordsEditBegin(row, len, row->size - len);
+  row->size = len;
+  row->chars[len] = '\0';
+  editorWordsEditEnd(row);
+  E.edits++;
+  editorJournalRecord(J_TRUNCATE, row - E.row, len, NULL, 0);
+  editorDiffRowChanged(row - E.row);
+  editorViewsDamage(row - E.row, row - E.row);
+}
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  editorWordsCountRow(&E.row[at], -1);
+  rowFree(E.row[at].chars, E.row[at].size);
+  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  E.numrows--;
+  E.edits++;
+  editorJournalRecord(J_DELETE_ROW, at, 0, NULL, 0);
+  editorDiffRowDeleted(at);
+  editorViewsRowDeleted(at);
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorWordsEditBegin(row, row->size, 0);
+  row->chars = rowResize(row->chars, row->size, row->size + len);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorWordsEditEnd(row);
+  E.edits++;
+  editorJournalRecord(J_APPEND, row - E.row, 0, s, len);
+  editorDiffRowChanged(row - E.row);
+  editorViewsDamage(row - E.row, row - E.row);
+}
+
+void editorInsertNewline(void) {
+  if (E.cy >= E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  } else {
+    erow *row = &E.row[E.cy];
+    if (E.cx == 0) {
+      editorInsertRow(E.cy, "", 0);
+    } else if (E.cx >= row->size) {
+      editorInsertRow(E.cy + 1, "", 0);
+    } else {
+      editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+      editorRowTruncate(&E.row[E.cy], E.cx);
+    }
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorDelChar(void) {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  erow *row = &E.row[E.cy];
+  if (E.cx > 0) {
+    // Normal character deletion
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  } else {
+    // At beginning of line - join with previous line
+    E.cx = E.row[E.cy - 1].size;
+    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+char *editorGetSelection(size_t *buflen) {
+    if (!E.selecting) return NULL;
+    if (E.block) return editorCursorsBlockText(buflen);
+
+    int start_y, start_x, end_y, end_x;
+    if (E.sel_start_y < E.cy || (E.sel_start_y == E.cy && E.sel_start_x <= E.cx)) {
+        start_y = E.sel_start_y;
+        start_x = E.sel_start_x;
+        end_y = E.cy;
+        end_x = E.cx;
+    } else {
+        start_y = E.cy;
+        start_x = E.cx;
+        end_y = E.sel_start_y;
+        end_x = E.sel_start_x;
+    }
+
+    if (start_y < 0 || end_y >= E.numrows) return NULL;
+
+    struct abuf ab = ABUF_INIT;
+
+    if (start_y == end_y) {
+        erow *row = editorRow(start_y);
+        if (start_x >= row->size || start_x >= end_x) {
+             abFree(&ab);
+             return NULL;
+        }
+        int len = end_x - start_x;
+        if (len > row->size - start_x) len = row->size - start_x;
+        abAppend(&ab, &row->chars[start_x], len);
+    } else {
+        erow *row = editorRow(start_y);
+        int len = row->size - start_x;
+        if (len > 0) abAppend(&ab, &row->chars[start_x], len);
+        abAppend(&ab, "\n", 1);
+
+        for (int i = start_y + 1; i < end_y; i++) {
+            row = editorRow(i);
+            abAppend(&ab, row->chars, row->size);
+            abAppend(&ab, "\n", 1);
+        }
+
+        row = editorRow(end_y);
+        if (end_x > 0) {
+             if (end_x > row->size) end_x = row->size;
+             abAppend(&ab, row->chars, end_x);
+        }
+    }
+    
+    if (buflen) *buflen = ab.len;
+    return ab.b;
+}
+
+void editorDeleteSelection(void) {
+    if (!E.selecting) return;
+    if (E.block) {
+        editorCursorsDeleteBlock();
+        return;
+    }
+
+    int start_y, start_x, end_y, end_x;
+    if (E.sel_start_y < E.cy || (E.sel_start_y == E.cy && E.sel_start_x <= E.cx)) {
+        start_y = E.sel_start_y;
+        start_x = E.sel_start_x;
+        end_y = E.cy;
+        end_x = E.cx;
+    } else {
+        start_y = E.cy;
+        start_x = E.cx;
+        end_y = E.sel_start_y;
+        end_x = E.sel_start_x;
+    }
+    
+    if (start_y < 0 || end_y >= E.numrows) return;
+
+    if (start_y == end_y) {
+        erow *row = &E.row[start_y];
+        if (start_x >= row->size || start_x >= end_x) return;
+        editorRowDelRange(row, start_x, end_x - start_x);
+    } else {
+        erow *first_row = &E.row[start_y];
+        erow *last_row = &E.row[end_y];
+        
+        char *last_line_remainder = &last_row->chars[end_x];
+        int remainder_len = last_row->size - end_x;
+        
+        editorRowTruncate(first_row, start_x);
+        editorRowAppendString(first_row, last_line_remainder, remainder_len);
+
+        for (int i = start_y + 1; i <= end_y; i++) {
+            editorDelRow(start_y + 1);
+        }
+    }
+    
+    E.cy = start_y;
+    E.cx = start_x;
+    E.selecting = 0;
+}
+
+/*********** replace *****************/
+
+#define REPLACE_MIN_ROWS_PER_THREAD 16384
+#define REPLACE_MAX_THREADS 8
+
+// One worker's share of a replace-all: a contiguous row range, and the
+// rebuilt buffers for the rows in it that had at least one match.
+typedef struct replaceJob {
+  int start, end;
+  const char *query;
+  int qlen;
+  const char *with;
+  int wlen;
+  undoRow *out;
+  int nout;
+  long count;
+} replaceJob;
+
+static void *editorReplaceWorker(void *arg) {
+  replaceJob *job = arg;
+  rowCarver rc = ROW_CARVER_INIT;
+  int *matches = NULL;
+  int matchcap = 0;
+  int outcap = 0;
+
+  for (int at = job->start; at < job->end; at++) {
+    erow *row = &E.row[at];
+
+    // Find every match first so the new row can be allocated exactly once
+    int n = 0;
+    char *p = row->chars;
+    char *m;
+    while ((m = strcasestr_impl(p, job->query)) != NULL) {
+      if (n == matchcap) {
+        matchcap = matchcap ? matchcap * 2 : 16;
+        matches = realloc(matches, sizeof(int) * matchcap);
+      }
+      matches[n++] = m - row->chars;
+      p = m + job->qlen;
+    }
+    if (n == 0) continue;
+
+    int size = row->size + n * (job->wlen - job->qlen);
+    char *chars = rowCarve(&rc, size);
+    char *dst = chars;
+    int from = 0;
+    for (int i = 0; i < n; i++) {
+      memcpy(dst, &row->chars[from], matches[i] - from);
+      dst += matches[i] - from;
+      memcpy(dst, job->with, job->wlen);
+      dst += job->wlen;
+      from = matches[i] + job->qlen;
+    }
+    memcpy(dst, &row->chars[from], row->size - from);
+    chars[size] = '\0';
+
+    if (job->nout == outcap) {
+      outcap = outcap ? outcap * 2 : 64;
+      job->out = realloc(job->out, sizeof(undoRow) * outcap);
+    }
+    job->out[job->nout].at = at;
+    job->out[job->nout].size = size;
+    job->out[job->nout].chars = chars;
+    job->nout++;
+    job->count += n;
+  }
+  free(matches);
+  rowCarverDone(&rc);
+  return NULL;
+}
+
+void editorFreeUndo(void) {
+  for (int i = 0; i < E.undo.numrows; i++) rowFree(E.undo.rows[i].chars, E.undo.rows[i].size);
+  free(E.undo.rows);
+  E.undo.rows = NULL;
+  E.undo.numrows = 0;
+}
+
+// Put n rebuilt rows in place of the ones at their r->at. The buffers
+// they replace are appended to E.undo.rows, which must have room.
+void editorSwapInRows(undoRow *rows, int n) {
+  editorWordsBatchBegin();
+  editorJournalBatchBegin();
+  for (int i = 0; i < n; i++) {
+    undoRow *r = &rows[i];
+    erow *row = &E.row[r->at];
+    undoRow *u = &E.undo.rows[E.undo.numrows++];
+    u->at = r->at;
+    u->size = row->size;
+    u->chars = row->chars;
+    row->size = r->size;
+    row->chars = r->chars;
+    editorWordsRowChanged(u->chars, u->size, row);
+    editorJournalRecord(J_SET_ROW, r->at, 0, row->chars, row->size);
+    editorDiffRowChanged(r->at);
+    editorViewsDamage(r->at, r->at);
+  }
+  editorJournalBatchEnd();
+  editorWordsBatchEnd();
+}
+
+// Replace every occurrence of query (matched the same way as search) with
+// `with`. Each affected row is rebuilt once; the old row buffers become
+// the undo step. Returns the number of replacements.
+long editorReplaceAll(const char *query, const char *with) {
+  int nthreads = 1;
+  if (E.numrows >= 2 * REPLACE_MIN_ROWS_PER_THREAD) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = E.numrows / REPLACE_MIN_ROWS_PER_THREAD;
+    if (nthreads > ncpu) nthreads = ncpu;
+    if (nthreads > REPLACE_MAX_THREADS) nthreads = REPLACE_MAX_THREADS;
+    if (nthreads < 1) nthreads = 1;
+  }
+
+  replaceJob jobs[REPLACE_MAX_THREADS];
+  pthread_t tids[REPLACE_MAX_THREADS];
+  int per = E.numrows / nthreads;
+  for (int t = 0; t < nthreads; t++) {
+    jobs[t].start = t * per;
+    jobs[t].end = (t == nthreads - 1) ? E.numrows : (t + 1) * per;
+    jobs[t].query = query;
+    jobs[t].qlen = strlen(query);
+    jobs[t].with = with;
+    jobs[t].wlen = strlen(with);
+    jobs[t].out = NULL;
+    jobs[t].nout = 0;
+    jobs[t].count = 0;
+  }
+
+  if (nthreads == 1) {
+    editorReplaceWorker(&jobs[0]);
+  } else {
+    for (int t = 0; t < nthreads; t++) {
+      if (pthread_create(&tids[t], NULL, editorReplaceWorker, &jobs[t]) != 0) {
+        // Fall back to running this share on the calling thread
+        editorReplaceWorker(&jobs[t]);
+        tids[t] = pthread_self();
+      }
+    }
+    for (int t = 0; t < nthreads; t++) {
+      if (!pthread_equal(tids[t], pthread_self())) pthread_join(tids[t], NULL);
+    }
+  }
+
+  long count = 0;
+  int nrows = 0;
+  for (int t = 0; t < nthreads; t++) {
+    count += jobs[t].count;
+    nrows += jobs[t].nout;
+  }
+  if (count == 0) return 0;
+
+  // Swap the rebuilt rows in; what comes out is the undo step
+  editorFreeUndo();
+  E.undo.rows = malloc(sizeof(undoRow) * nrows);
+  for (int t = 0; t < nthreads; t++) {
+    editorSwapInRows(jobs[t].out, jobs[t].nout);
+    free(jobs[t].out);
+  }
+  E.undo.cx = E.cx;
+  E.undo.cy = E.cy;
+  E.edits++;
+  E.undo.edits = E.edits;
+
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  return count;
+}
+
+void editorUndo(void) {
+  if (E.undo.numrows == 0 || E.undo.edits != E.edits) {
+    editorFreeUndo();
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  editorWordsBatchBegin();
+  editorJournalBatchBegin();
+  for (int i = 0; i < E.undo.numrows; i++) {
+    undoRow *u = &E.undo.rows[i];
+    erow *row = &E.row[u->at];
+    // Swap rather than free, so the words counted out stay readable
+    // until the batch ends; editorFreeUndo() frees them after
+    char *chars = row->chars;
+    int size = row->size;
+    row->size = u->size;
+    row->chars = u->chars;
+    u->chars = chars;
+    u->size = size;
+    editorWordsRowChanged(u->chars, u->size, row);
+    editorJournalRecord(J_SET_ROW, u->at, 0, row->chars, row->size);
+    editorDiffRowChanged(u->at);
+    editorViewsDamage(u->at, u->at);
+  }
+  editorJournalBatchEnd();
+  editorWordsBatchEnd();
+  E.cx = E.undo.cx;
+  E.cy = E.undo.cy;
+  editorCursorsClear(); // they were placed for the text being taken back
+  editorSetStatusMessage("Undid change to %d lines", E.undo.numrows);
+  editorFreeUndo();
+  E.edits++;
+}
+
+/*********** multiple cursors *****************/
+
+// Besides the cursor at E.cx, E.cy there can be any number of others in
+// E.cursors. Ctrl-K leaves one where the cursor is and moves down a line;
+// Ctrl-L starts a block selection, and typing over a block leaves one on
+// each of its rows. A typed character, Backspace or Delete is then
+// applied at every cursor as one batch: each affected row is rebuilt
+// once with all of its edits, the cursors are moved along in the same
+// pass, and the rows are swapped in the way a replace-all does it, so
+// Ctrl-Z takes the whole batch back.
+
+// Where a batch edits: len characters at x on row y go (for Backspace
+// and Delete with len 0, the one before or at x), then the typed text is
+// put in their place, and *cx follows it.
+typedef struct editSpot {
+  int y, x, len;
+  int *cx;
+} editSpot;
+
+static int cursorCmp(const void *a, const void *b) {
+  const editorCursor *p = a, *q = b;
+  if (p->y != q->y) return p->y < q->y ? -1 : 1;
+  return (p->x > q->x) - (p->x < q->x);
+}
+
+static void cursorsDamage(void) {
+  if (E.ncursors) editorViewsDamage(E.cursors[0].y, E.cursors[E.ncursors - 1].y);
+}
+
+// Drop duplicates, and cursors that ended up where E.cx, E.cy is.
+static void cursorsDedup(void) {
+  int n = 0;
+  for (int i = 0; i < E.ncursors; i++) {
+    editorCursor c = E.cursors[i];
+    if (c.y == E.cy && c.x == E.cx) continue;
+    if (n > 0 && cursorCmp(&E.cursors[n - 1], &c) == 0) continue;
+    E.cursors[n++] = c;
+  }
+  E.ncursors = n;
+}
+
+void editorCursorsClear(void) {
+  cursorsDamage();
+  free(E.cursors);
+  E.cursors = NULL;
+  E.ncursors = 0;
+}
+
+// Index of the first cursor on row y or after it.
+int editorCursorsFrom(int y) {
+  int lo = 0, hi = E.ncursors;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (E.cursors[mid].y < y) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Leave a cursor where E.cx, E.cy is (or take away the one there) and
+// move down a line, so a column of them takes one key per row.
+void editorCursorsAdd(void) {
+  editorCursor c = { E.cy, E.cx };
+  editorCursor *at = E.ncursors ? bsearch(&c, E.cursors, E.ncursors, sizeof(editorCursor), cursorCmp) : NULL;
+  if (at) {
+    memmove(at, at + 1, sizeof(editorCursor) * (E.ncursors - (at - E.cursors) - 1));
+    E.ncursors--;
+  } else {
+    int i = editorCursorsFrom(c.y);
+    while (i < E.ncursors && E.cursors[i].y == c.y && E.cursors[i].x < c.x) i++;
+    E.cursors = realloc(E.cursors, sizeof(editorCursor) * (E.ncursors + 1));
+    memmove(&E.cursors[i + 1], &E.cursors[i], sizeof(editorCursor) * (E.ncursors - i));
+    E.cursors[i] = c;
+    E.ncursors++;
+  }
+  editorViewsDamage(c.y, c.y);
+  editorMoveCursor(ARROW_DOWN);
+  cursorsDedup();
+  editorSetStatusMessage("%d cursors", E.ncursors + 1);
+}
+
+// Move the other cursors the way key just moved E.cx, E.cy.
+void editorCursorsMove(int key) {
+  int cx = E.cx, cy = E.cy;
+  cursorsDamage();
+  for (int i = 0; i < E.ncursors; i++) {
+    E.cx = E.cursors[i].x;
+    E.cy = E.cursors[i].y;
+    if (key == HOME_KEY) E.cx = 0;
+    else if (key == END_KEY) E.cx = E.cy < E.numrows ? E.row[E.cy].size : 0;
+    else editorMoveCursor(key);
+    E.cursors[i].x = E.cx;
+    E.cursors[i].y = E.cy;
+  }
+  E.cx = cx;
+  E.cy = cy;
+  // Only those stopped at the top or bottom can have passed others
+  qsort(E.cursors, E.ncursors, sizeof(editorCursor), cursorCmp);
+  cursorsDedup();
+  cursorsDamage();
+}
+
+// The corners of the block selection: rows top..bottom, columns
+// left up to right.
+static void blockBounds(int *top, int *left, int *bottom, int *right) {
+  *top = E.sel_start_y < E.cy ? E.sel_start_y : E.cy;
+  *bottom = E.sel_start_y < E.cy ? E.cy : E.sel_start_y;
+  *left = E.sel_start_x < E.cx ? E.sel_start_x : E.cx;
+  *right = E.sel_start_x < E.cx ? E.cx : E.sel_start_x;
+  if (*bottom >= E.numrows) *bottom = E.numrows - 1;
+}
+
+// The spots a batch edits. A block selection turns into a cursor on each
+// of its rows long enough to reach its left edge, standing there.
+static editSpot *cursorsSpots(int *count) {
+  editSpot *spots;
+  int n = 0;
+  if (E.selecting && E.block) {
+    int top, left, bottom, right;
+    blockBounds(&top, &left, &bottom, &right);
+    cursorsDamage();
+    free(E.cursors);
+    E.cursors = malloc(sizeof(editorCursor) * (bottom - top + 1 > 0 ? bottom - top + 1 : 1));
+    E.ncursors = 0;
+    E.selecting = 0;
+    E.block = 0;
+    int primary = E.cy >= top && E.cy <= bottom && E.row[E.cy].size >= left;
+    if (primary) E.cx = left;
+    spots = malloc(sizeof(editSpot) * (bottom - top + 2));
+    for (int y = top; y <= bottom; y++) {
+      if (E.row[y].size < left) continue;
+      int *cx = &E.cx;
+      if (y != E.cy || !primary) {
+        E.cursors[E.ncursors] = (editorCursor){ y, left };
+        cx = &E.cursors[E.ncursors++].x;
+      }
+      spots[n++] = (editSpot){ y, left, right - left, cx };
+    }
+    if (E.ncursors == 0) editorCursorsClear();
+  } else {
+    spots = malloc(sizeof(editSpot) * (E.ncursors + 1));
+    int primary = 0;
+    for (int i = 0; i < E.ncursors; i++) {
+      editorCursor *c = &E.cursors[i];
+      if (!primary && (E.cy < c->y || (E.cy == c->y && E.cx < c->x))) {
+        spots[n++] = (editSpot){ E.cy, E.cx, 0, &E.cx };
+        primary = 1;
+      }
+      spots[n++] = (editSpot){ c->y, c->x, 0, &c->x };
+    }
+    if (!primary) spots[n++] = (editSpot){ E.cy, E.cx, 0, &E.cx };
+  }
+  *count = n;
+  return spots;
+}
+
+// Apply one edit at every cursor: del is 0 to type s, -1 for Backspace
+// and 1 for Delete. Only text within rows is touched, so Backspace at
+// the start of a row and Delete at its end do nothing there. Returns 1
+// if there were other cursors (or a block) to apply it to.
+int editorCursorsApply(const char *s, int slen, int del) {
+  if (E.ncursors == 0 && !(E.selecting && E.block)) return 0;
+
+  int cx = E.cx, cy = E.cy;
+  int nspots;
+  editSpot *spots = cursorsSpots(&nspots);
+  undoRow *out = malloc(sizeof(undoRow) * (nspots > 0 ? nspots : 1));
+  int nout = 0;
+
+  int i = 0;
+  while (i < nspots) {
+    int y = spots[i].y;
+    int end = i;
+    while (end < nspots && spots[end].y == y) end++;
+    if (y >= E.numrows) {
+      i = end;
+      continue;
+    }
+    erow *row = &E.row[y];
+
+    // What goes at each spot, in row order and without overlaps
+    int size = row->size;
+    int prev = 0;
+    for (int j = i; j < end; j++) {
+      editSpot *sp = &spots[j];
+      int from = sp->x < row->size ? sp->x : row->size;
+      int to = from + sp->len;
+      if (sp->len == 0 && del < 0 && from > 0) from--;
+      if (sp->len == 0 && del > 0) to++;
+      if (from < prev) from = prev;
+      if (to > row->size) to = row->size;
+      if (to < from) to = from;
+      sp->x = from;
+      sp->len = to - from;
+      prev = to;
+      size += (del ? 0 : slen) - sp->len;
+    }
+
+    char *chars = rowAlloc(size);
+    char *dst = chars;
+    int from = 0;
+    for (int j = i; j < end; j++) {
+      editSpot *sp = &spots[j];
+      memcpy(dst, &row->chars[from], sp->x - from);
+      dst += sp->x - from;
+      if (!del) {
+        memcpy(dst, s, slen);
+        dst += slen;
+      }
+      *sp->cx = dst - chars;
+      from = sp->x + sp->len;
+    }
+    memcpy(dst, &row->chars[from], row->size - from);
+    chars[size] = '\0';
+
+    if (size == row->size && memcmp(chars, row->chars, size) == 0) {
+      rowFree(chars, size); // nothing to delete at any of its spots
+    } else {
+      out[nout++] = (undoRow){ .at = y, .size = size, .chars = chars };
+    }
+    i = end;
+  }
+  free(spots);
+
+  if (nout > 0) {
+    editorFreeUndo();
+    E.undo.rows = malloc(sizeof(undoRow) * nout);
+    editorSwapInRows(out, nout);
+    E.undo.cx = cx;
+    E.undo.cy = cy;
+    E.edits++;
+    E.undo.edits = E.edits;
+  }
+  free(out);
+  cursorsDedup();
+  cursorsDamage();
+  return 1;
+}
+
+// The text of the block selection, a line per row.
+char *editorCursorsBlockText(size_t *buflen) {
+  int top, left, bottom, right;
+  blockBounds(&top, &left, &bottom, &right);
+  struct abuf ab = ABUF_INIT;
+  for (int y = top; y <= bottom; y++) {
+    erow *row = editorRow(y);
+    if (left < row->size) abAppend(&ab, &row->chars[left], (right < row->size ? right : row->size) - left);
+    if (y < bottom) abAppend(&ab, "\n", 1);
+  }
+  abAppend(&ab, "", 1);
+  if (buflen) *buflen = ab.len - 1;
+  return ab.b;
+}
+
+// Cut the block selection out as a batch, leaving no cursors behind.
+void editorCursorsDeleteBlock(void) {
+  int top, left, bottom, right;
+  blockBounds(&top, &left, &bottom, &right);
+  if (left < right) editorCursorsApply(NULL, 0, 1);
+  E.selecting = 0;
+  E.block = 0;
+  editorCursorsClear();
+}
+
+/*********** journal   *****************/
+
+// Every edit is appended to a swap journal next to the file as a compact
+// binary record: an op byte, varint row/column/length and the inserted
+// bytes. Records collect in memory and a background thread writes and
+// fsyncs them once JOURNAL_FLUSH_MS have passed or JOURNAL_FLUSH_BYTES
+// are pending, so typing never waits on the disk. The header records the
+// size and mtime of the file the edits apply to; if the editor dies, the
+// next session replays the journal onto that same file.
+
+#define JOURNAL_MAGIC "CILOJRN1"
+#define JOURNAL_FLUSH_MS 1000
+#define JOURNAL_FLUSH_BYTES (64 * 1024)
+
+typedef struct journalHeader {
+  char magic[8];
+  long long size;
+  long long mtime_sec;
+  long long mtime_nsec;
+} journalHeader;
+
+struct journalState {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+  int stop;
+  char *path;
+  int fd;               // opened lazily by the flush thread
+  journalHeader header;
+  int reset;            // the flush thread must truncate and rewrite the header
+  struct abuf pending;  // records not yet handed to the kernel
+  struct abuf batch;    // records of the batch in progress
+  int batchcap;         // bytes allocated for batch
+  int batching;
+  int replaying;
+  int recover;          // a journal from a crashed session awaits replay
+  int error;            // errno of a failed write, for the main thread to report
+  int lost;             // a record was lost: journal nothing until the next reset
+};
+
+static struct journalState *journal; // of the active buffer
+
+static void journalStateInit(struct journalState *j) {
+  *j = (struct journalState){ .fd = -1, .pending = ABUF_INIT, .batch = ABUF_INIT };
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->cond, NULL);
+}
+
+// Records after a lost one would replay onto the wrong text, so the
+// journal stops where it is still whole.
+static void journalLose(int err) {
+  journal->lost = 1;
+  editorSetStatusMessage("Swap file %s: %s, off until the next save",
+    journal->path, strerror(err));
+}
+
+// Pass records to the flush thread; rec is left empty.
+static void journalHandOver(struct abuf *rec) {
+  pthread_mutex_lock(&journal->lock);
+  int was_empty = journal->pending.len == 0;
+  int ok = 1;
+  if (was_empty) {
+    free(journal->pending.b);
+    journal->pending = *rec;
+  } else {
+    int len = journal->pending.len;
+    abAppend(&journal->pending, rec->b, rec->len);
+    ok = journal->pending.len == len + rec->len;
+    abFree(rec);
+  }
+  // An idle thread waits for the first record, a busy one for a full buffer
+  if (was_empty || journal->pending.len >= JOURNAL_FLUSH_BYTES) pthread_cond_signal(&journal->cond);
+  pthread_mutex_unlock(&journal->lock);
+  *rec = (struct abuf)ABUF_INIT;
+  if (!ok) journalLose(ENOMEM);
+}
+
+void editorJournalRecord(int op, int a, int b, const char *s, int len) {
+  if (!journal->running || journal->replaying || journal->lost) return;
+
+  char head[31];
+  int hlen = 0;
+  head[hlen++] = op;
+  hlen += putVarint(&head[hlen], a);
+  hlen += putVarint(&head[hlen], b);
+  hlen += putVarint(&head[hlen], len);
+  if (!s) len = 0;
+  if (!journal->batching) {
+    struct abuf rec = ABUF_INIT;
+    abAppend(&rec, head, hlen);
+    if (len > 0) abAppend(&rec, s, len);
+    if (rec.len != hlen + len) {
+      abFree(&rec);
+      journalLose(ENOMEM);
+      return;
+    }
+    journalHandOver(&rec);
+    return;
+  }
+
+  // A batch can run to millions of records, so grow it geometrically
+  struct abuf *ab = &journal->batch;
+  if (ab->len + hlen + len > journal->batchcap) {
+    int cap = journal->batchcap ? journal->batchcap : 4096;
+    while (cap < ab->len + hlen + len) cap *= 2;
+    char *nb = realloc(ab->b, cap);
+    if (nb == NULL) {
+      journalLose(ENOMEM);
+      return;
+    }
+    ab->b = nb;
+    journal->batchcap = cap;
+  }
+  memcpy(&ab->b[ab->len], head, hlen);
+  ab->len += hlen;
+  if (len > 0) memcpy(&ab->b[ab->len], s, len);
+  ab->len += len;
+}
+
+// The records of edits made between editorJournalBatchBegin() and
+// editorJournalBatchEnd() reach the flush thread together, for one lock
+// round trip instead of one per row.
+void editorJournalBatchBegin(void) {
+  journal->batching = 1;
+}
+
+void editorJournalBatchEnd(void) {
+  journal->batching = 0;
+  if (journal->batch.len > 0 && !journal->lost) journalHandOver(&journal->batch);
+  abFree(&journal->batch);
+  journal->batch = (struct abuf)ABUF_INIT;
+  journal->batchcap = 0;
+}
+
+// Returns 0, or the errno of a failed or short write.
+static int journalWrite(int fd, const void *buf, size_t len) {
+  ssize_t n = write(fd, buf, len);
+  if (n == (ssize_t)len) return 0;
+  return n == -1 ? errno : ENOSPC;
+}
+
+static void *journalThread(void *arg) {
+  struct journalState *jr = arg;
+  off_t good = 0;  // length of the file up to its last whole record
+  int broken = 0;  // a write failed: drop records until the next reset
+  pthread_mutex_lock(&jr->lock);
+  while (1) {
+    // Nothing to do until an edit comes in
+    while (!jr->stop && !jr->reset && jr->pending.len == 0)
+      pthread_cond_wait(&jr->cond, &jr->lock);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += JOURNAL_FLUSH_MS / 1000;
+    deadline.tv_nsec += (JOURNAL_FLUSH_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!jr->stop && jr->pending.len < JOURNAL_FLUSH_BYTES) {
+      if (pthread_cond_timedwait(&jr->cond, &jr->lock, &deadline) == ETIMEDOUT) break;
+    }
+
+    struct abuf out = jr->pending;
+    jr->pending.b = NULL;
+    jr->pending.len = 0;
+    int reset = jr->reset;
+    jr->reset = 0;
+    journalHeader header = jr->header;
+    int stop = jr->stop;
+    pthread_mutex_unlock(&jr->lock);
+
+    int err = 0;
+    if ((out.len > 0 || reset) && jr->fd == -1) {
+      jr->fd = open(jr->path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+      if (jr->fd == -1) {
+        err = errno;
+      } else {
+        good = lseek(jr->fd, 0, SEEK_END);
+        if (good == 0) reset = 1;
+      }
+    }
+    if (jr->fd != -1) {
+      if (reset) {
+        broken = 0;
+        good = 0;
+        if (ftruncate(jr->fd, 0) == -1) err = errno;
+        else if ((err = journalWrite(jr->fd, &header, sizeof(header))) == 0) good = sizeof(header);
+      }
+      if (out.len > 0 && !broken && !err) {
+        if ((err = journalWrite(jr->fd, out.b, out.len)) == 0) good += out.len;
+      }
+      if (!err && (out.len > 0 || reset) && fsync(jr->fd) == -1) err = errno;
+      if (err) {
+        // Cut a torn record off, so a replay stops where the journal is whole
+        ftruncate(jr->fd, good);
+        broken = 1;
+      }
+    }
+    abFree(&out);
+
+    pthread_mutex_lock(&jr->lock);
+    if (err) jr->error = err;
+    if (stop) break;
+  }
+  pthread_mutex_unlock(&jr->lock);
+  return NULL;
+}
+
+static void journalFillHeader(journalHeader *h) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+  struct stat st;
+  if (stat(E.filename, &st) == 0) {
+    h->size = st.st_size;
+    h->mtime_sec = st.st_mtim.tv_sec;
+    h->mtime_nsec = st.st_mtim.tv_nsec;
+  }
+}
+
+// Start journaling edits to E.filename. An existing journal that matches
+// the file on disk is kept for editorJournalPoll() to offer recovery.
+void editorJournalOpen(void) {
+  if (E.filename == NULL || E.viewer) return;
+
+  const char *slash = strrchr(E.filename, '/');
+  int dirlen = slash ? slash - E.filename + 1 : 0;
+  size_t len = strlen(E.filename) + 6;
+  journal->path = malloc(len);
+  snprintf(journal->path, len, "%.*s.%s.swp", dirlen, E.filename, E.filename + dirlen);
+
+  journalFillHeader(&journal->header);
+  journal->reset = 1;
+  journal->recover = 0;
+
+  int fd = open(journal->path, O_RDONLY);
+  if (fd != -1) {
+    journalHeader old;
+    struct stat st;
+    if (read(fd, &old, sizeof(old)) == sizeof(old) && fstat(fd, &st) == 0 &&
+        memcmp(old.magic, JOURNAL_MAGIC, sizeof(old.magic)) == 0 &&
+        st.st_size > (off_t)sizeof(old)) {
+      if (old.size == journal->header.size && old.mtime_sec == journal->header.mtime_sec &&
+          old.mtime_nsec == journal->header.mtime_nsec) {
+        journal->recover = 1;
+        journal->reset = 0;
+      } else {
+        editorSetStatusMessage("Swap file %s is for another version of the file, discarding it",
+          journal->path);
+      }
+    }
+    close(fd);
+  }
+
+  journal->stop = 0;
+  if (pthread_create(&journal->thread, NULL, journalThread, journal) != 0) return;
+  journal->running = 1;
+}
+
+// The buffer now matches the file on disk: start a fresh journal.
+void editorJournalReset(void) {
+  if (!journal->running) return;
+  journal->lost = 0;
+  pthread_mutex_lock(&journal->lock);
+  journal->error = 0;
+  abFree(&journal->pending);
+  journal->pending.b = NULL;
+  journal->pending.len = 0;
+  journalFillHeader(&journal->header);
+  journal->reset = 1;
+  journal->recover = 0;
+  pthread_cond_signal(&journal->cond);
+  pthread_mutex_unlock(&journal->lock);
+}
+
+// Flush whatever is pending and stop the thread; with `discard` the
+// journal is removed as well (a deliberate quit).
+void editorJournalClose(int discard) {
+  if (!journal->running) return;
+  pthread_mutex_lock(&journal->lock);
+  journal->stop = 1;
+  pthread_cond_signal(&journal->cond);
+  pthread_mutex_unlock(&journal->lock);
+  pthread_join(journal->thread, NULL);
+  journal->running = 0;
+  if (journal->fd != -1) close(journal->fd);
+  journal->fd = -1;
+  if (discard) unlink(journal->path);
+}
+
+static int journalApply(int op, int a, int b, const char *s, int len) {
+  if (op == J_INSERT_ROW) {
+    if (a < 0 || a > E.numrows) return -1;
+    editorInsertRow(a, (char *)s, len);
+    return 0;
+  }
+  if (a < 0 || a >= E.numrows) return -1;
+  erow *row = &E.row[a];
+  switch (op) {
+    case J_DELETE_ROW: editorDelRow(a); break;
+    case J_INSERT_CHAR: editorRowInsertChar(row, b, len ? s[0] : ' '); break;
+    case J_DELETE: editorRowDelRange(row, b, len); break;
+    case J_APPEND: editorRowAppendString(row, (char *)s, len); break;
+    case J_TRUNCATE: editorRowTruncate(row, b); break;
+    case J_SET_ROW:
+      editorWordsCountRow(row, -1);
+      rowFree(row->chars, row->size);
+      row->chars = rowAlloc(len);
+      memcpy(row->chars, s, len);
+      row->chars[len] = '\0';
+      row->size = len;
+      editorWordsCountRow(row, 1);
+      editorDiffRowChanged(a);
+      editorViewsDamage(a, a);
+      E.edits++;
+      break;
+    default: return -1;
+  }
+  return 0;
+}
+
+// Replay the journal of a crashed session onto the freshly loaded file.
+static void journalReplay(void) {
+  int fd = open(journal->path, O_RDONLY);
+  if (fd == -1) return;
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return;
+  }
+  char *data = malloc(st.st_size);
+  if (data == NULL) {
+    close(fd);
+    return;
+  }
+  ssize_t n = read(fd, data, st.st_size);
+  close(fd);
+  if (n < (ssize_t)sizeof(journalHeader)) {
+    free(data);
+    return;
+  }
+
+  const char *p = data + sizeof(journalHeader);
+  const char *end = data + n;
+  int applied = 0;
+  journal->replaying = 1;
+  while (p < end) {
+    int op = *p++;
+    unsigned long long a, b, len;
+    if (getVarint(&p, end, &a) == -1 || getVarint(&p, end, &b) == -1 ||
+        getVarint(&p, end, &len) == -1)
+      break;
+    if (a > INT_MAX || b > INT_MAX || len > INT_MAX) break;
+    int has_bytes = op != J_DELETE && len > 0;
+    if (has_bytes && (unsigned long long)(end - p) < len) break; // torn last record
+    if (journalApply(op, a, b, p, len) == -1) break;
+    if (has_bytes) p += len;
+    applied++;
+  }
+  journal->replaying = 0;
+  free(data);
+
+  if (E.cy >= E.numrows) E.cy = E.numrows;
+  E.cx = 0;
+  editorSetStatusMessage("Recovered %d changes from %s", applied, journal->path);
+}
+
+// Report a failed write; once the file has finished loading, offer to
+// recover a crashed session.
+int editorJournalPoll(void) {
+  if (journal->running) {
+    pthread_mutex_lock(&journal->lock);
+    int err = journal->error;
+    journal->error = 0;
+    pthread_mutex_unlock(&journal->lock);
+    if (err && !journal->lost) {
+      journalLose(err);
+      return 1;
+    }
+  }
+  if (!journal->recover || E.loading) return 0;
+  journal->recover = 0;
+
+  editorSetStatusMessage("Swap file %s found. Recover unsaved changes? (y/n)", journal->path);
+  editorRefreshScreen();
+  int c;
+  prompt_open = 1;
+  do {
+    c = editorReadKey();
+  } while (c != 'y' && c != 'Y' && c != 'n' && c != 'N' && c != '\x1b');
+  prompt_open = 0;
+
+  if (c == 'y' || c == 'Y') {
+    // Keep the journal as is: it still describes the buffer from the file
+    journalReplay();
+  } else {
+    editorJournalReset();
+    editorSetStatusMessage("Discarded swap file");
+  }
+  return 1;
+}
+
+/*********** word index   *****************/
+
+// Words of the file (runs of alphanumerics and '_') with occurrence
+// counts, kept as an array sorted by word so a completion query is a
+// binary search for the prefix plus a short scan. A background thread
+// counts the file on disk after editorOpen and merges its counts in;
+// edits adjust the counts of just the words around the changed bytes.
+// Counts from the two sources simply add up, so it does not matter
+// which arrives first.
+
+#define WORD_MIN_LEN 2
+#define WORD_MAX_LEN 64
+#define WORD_SCAN_MAX 20000 // entries looked at per query
+#define WORD_HASH_INITIAL 4096
+#define WORD_BATCH_MERGE 64 // distinct words a batch needs to be merged rather than adjusted
+
+typedef struct wordEntry {
+  char *word;
+  int len;
+  int count;
+} wordEntry;
+
+// Counts collected into a hash table before they go into the entries, by
+// the builder thread and by editorWordsBatchBegin().
+typedef struct wordSlot {
+  char *word;
+  int len;
+  int count;
+  unsigned int hash;
+} wordSlot;
+
+static struct {
+  pthread_mutex_t lock;
+  int enabled;
+  wordEntry *entries;
+  int numentries;
+  int cap;
+  int span_start;  // word span of the edit in progress, see editorWordsEditBegin
+  int span_tail;
+  wordSlot *batch; // counts of the batch in progress, or NULL
+  int batchcap;
+  int batchused;
+} words = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void wordTableAdd(wordSlot **table, int *cap, int *used, const char *w, int len, int delta, int copy);
+
+static int isWordChar(int c) {
+  return isalnum(c) || c == '_';
+}
+
+static int wordCompare(const char *a, int alen, const char *b, int blen) {
+  int n = alen < blen ? alen : blen;
+  int cmp = memcmp(a, b, n);
+  if (cmp) return cmp;
+  return alen - blen;
+}
+
+// Index of the first entry not less than w. Caller holds the lock.
+static int wordsLowerBound(const char *w, int len) {
+  int lo = 0, hi = words.numentries;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (wordCompare(words.entries[mid].word, words.entries[mid].len, w, len) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Caller holds the lock.
+static void wordsAdjust(const char *w, int len, int delta) {
+  int i = wordsLowerBound(w, len);
+  if (i < words.numentries && wordCompare(words.entries[i].word, words.entries[i].len, w, len) == 0) {
+    words.entries[i].count += delta;
+    if (words.entries[i].count == 0) {
+      free(words.entries[i].word);
+      memmove(&words.entries[i], &words.entries[i + 1],
+        sizeof(wordEntry) * (words.numentries - i - 1));
+      words.numentries--;
+    }
+    return;
+  }
+  if (words.numentries == words.cap) {
+    words.cap = words.cap ? words.cap * 2 : 1024;
+    words.entries = realloc(words.entries, sizeof(wordEntry) * words.cap);
+  }
+  memmove(&words.entries[i + 1], &words.entries[i], sizeof(wordEntry) * (words.numentries - i));
+  words.entries[i].word = malloc(len);
+  memcpy(words.entries[i].word, w, len);
+  words.entries[i].len = len;
+  words.entries[i].count = delta;
+  words.numentries++;
+}
+
+// Add delta to the count of every word in s[0..len).
+static void wordsCountSpan(const char *s, int len, int delta) {
+  int i = 0;
+  if (!words.batch) pthread_mutex_lock(&words.lock);
+  while (i < len) {
+    while (i < len && !isWordChar((unsigned char)s[i])) i++;
+    int start = i;
+    while (i < len && isWordChar((unsigned char)s[i])) i++;
+    int wlen = i - start;
+    if (wlen < WORD_MIN_LEN || wlen > WORD_MAX_LEN) continue;
+    if (words.batch) wordTableAdd(&words.batch, &words.batchcap, &words.batchused, &s[start], wlen, delta, 0);
+    else wordsAdjust(&s[start], wlen, delta);
+  }
+  if (!words.batch) pthread_mutex_unlock(&words.lock);
 }
 
-void editorInsertNewline(void) {
-  if (E.cy >= E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+void editorWordsCountRow(erow *row, int delta) {
+  if (!words.enabled) return;
+  wordsCountSpan(row->chars, row->size, delta);
+}
+
+// Bytes [at, at+len) of row are about to be replaced: forget the words
+// they touch. editorWordsEditEnd() then counts the words of the same
+// span as it reads after the change.
+void editorWordsEditBegin(erow *row, int at, int len) {
+  if (!words.enabled) return;
+  int start = at;
+  int end = at + len;
+  while (start > 0 && isWordChar((unsigned char)row->chars[start - 1])) start--;
+  while (end < row->size && isWordChar((unsigned char)row->chars[end])) end++;
+  words.span_start = start;
+  words.span_tail = row->size - end;
+  wordsCountSpan(&row->chars[start], end - start, -1);
+}
+
+void editorWordsEditEnd(erow *row) {
+  if (!words.enabled) return;
+  int end = row->size - words.span_tail;
+  if (end > words.span_start) wordsCountSpan(&row->chars[words.span_start], end - words.span_start, 1);
+}
+
+// The text of row was old[0..oldsize) and has been swapped for a new one:
+// recount the words touching the bytes that differ, found by trimming the
+// prefix and suffix the two have in common.
+void editorWordsRowChanged(const char *old, int oldsize, erow *row) {
+  if (!words.enabled) return;
+  const char *new = row->chars;
+  int min = oldsize < row->size ? oldsize : row->size;
+  int start = 0;
+  while (start < min && old[start] == new[start]) start++;
+  int tail = 0;
+  while (tail < min - start && old[oldsize - 1 - tail] == new[row->size - 1 - tail]) tail++;
+  if (start + tail == oldsize && oldsize == row->size) return;
+  while (start > 0 && isWordChar((unsigned char)old[start - 1])) start--;
+  while (tail > 0 && isWordChar((unsigned char)old[oldsize - tail])) tail--;
+  wordsCountSpan(&old[start], oldsize - tail - start, -1);
+  wordsCountSpan(&new[start], row->size - tail - start, 1);
+}
+
+// Up to max of the most frequent words that extend prefix, best first.
+// The returned strings are the caller's to free.
+int editorWordsComplete(const char *prefix, int plen, char **out, int max) {
+  wordEntry *best[max];
+  int n = 0;
+  pthread_mutex_lock(&words.lock);
+  int i = wordsLowerBound(prefix, plen);
+  int end = i + WORD_SCAN_MAX;
+  if (end > words.numentries) end = words.numentries;
+  for (; i < end; i++) {
+    wordEntry *w = &words.entries[i];
+    if (w->len < plen || memcmp(w->word, prefix, plen) != 0) break;
+    if (w->len == plen || w->count <= 0) continue;
+    // Insert into the short best-first list
+    if (n < max) n++;
+    else if (best[max - 1]->count >= w->count) continue;
+    int j = n - 1;
+    while (j > 0 && best[j - 1]->count < w->count) {
+      best[j] = best[j - 1];
+      j--;
+    }
+    best[j] = w;
+  }
+  for (int k = 0; k < n; k++) {
+    out[k] = malloc(best[k]->len + 1);
+    memcpy(out[k], best[k]->word, best[k]->len);
+    out[k][best[k]->len] = '\0';
+  }
+  pthread_mutex_unlock(&words.lock);
+  return n;
+}
+
+static unsigned int wordHash(const char *s, int len) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+// With copy unset the slot points into w instead of holding a copy.
+static void wordTableAdd(wordSlot **table, int *cap, int *used, const char *w, int len, int delta, int copy) {
+  if (*used * 2 >= *cap) {
+    int newcap = *cap * 2;
+    wordSlot *nt = calloc(newcap, sizeof(wordSlot));
+    for (int i = 0; i < *cap; i++) {
+      if (!(*table)[i].word) continue;
+      unsigned int j = (*table)[i].hash & (newcap - 1);
+      while (nt[j].word) j = (j + 1) & (newcap - 1);
+      nt[j] = (*table)[i];
+    }
+    free(*table);
+    *table = nt;
+    *cap = newcap;
+  }
+  unsigned int h = wordHash(w, len);
+  unsigned int j = h & (*cap - 1);
+  while ((*table)[j].word) {
+    wordSlot *s = &(*table)[j];
+    if (s->hash == h && s->len == len && memcmp(s->word, w, len) == 0) {
+      s->count += delta;
+      return;
+    }
+    j = (j + 1) & (*cap - 1);
+  }
+  if (copy) {
+    (*table)[j].word = malloc(len);
+    memcpy((*table)[j].word, w, len);
   } else {
-    erow *row = &E.row[E.cy];
-    if (E.cx == 0) {
-      editorInsertRow(E.cy, "", 0);
-    } else if (E.cx >= row->size) {
-      editorInsertRow(E.cy + 1, "", 0);
+    (*table)[j].word = (char *)w;
+  }
+  (*table)[j].len = len;
+  (*table)[j].count = delta;
+  (*table)[j].hash = h;
+  (*used)++;
+}
+
+static int wordSlotCompare(const void *a, const void *b) {
+  const wordSlot *x = a, *y = b;
+  return wordCompare(x->word, x->len, y->word, y->len);
+}
+
+// Add the counts of a hash table to the entries and free it: compact and
+// sort it, then merge the two sorted lists in one pass under the lock.
+// With owned unset the table's words are borrowed and copied as needed.
+static void wordsMergeTable(wordSlot *table, int cap, int owned) {
+  int m = 0;
+  for (int i = 0; i < cap; i++) {
+    if (!table[i].word) continue;
+    if (table[i].count != 0) table[m++] = table[i];
+    else if (owned) free(table[i].word);
+  }
+  qsort(table, m, sizeof(wordSlot), wordSlotCompare);
+
+  pthread_mutex_lock(&words.lock);
+  int mergedcap = words.numentries + m + 1;
+  wordEntry *merged = malloc(sizeof(wordEntry) * mergedcap);
+  int a = 0, b = 0, k = 0;
+  while (a < words.numentries || b < m) {
+    int cmp;
+    if (a == words.numentries) cmp = 1;
+    else if (b == m) cmp = -1;
+    else cmp = wordCompare(words.entries[a].word, words.entries[a].len, table[b].word, table[b].len);
+
+    if (cmp < 0) {
+      merged[k++] = words.entries[a++];
+    } else if (cmp > 0) {
+      merged[k].word = owned ? table[b].word : memcpy(malloc(table[b].len), table[b].word, table[b].len);
+      merged[k].len = table[b].len;
+      merged[k++].count = table[b++].count;
     } else {
-      editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-      row = &E.row[E.cy];
-      row->size = E.cx;
-      row->chars[row->size] = '\0';
+      merged[k] = words.entries[a++];
+      merged[k].count += table[b].count;
+      if (owned) free(table[b].word);
+      b++;
+      if (merged[k].count == 0) free(merged[k].word);
+      else k++;
     }
   }
-  E.cy++;
-  E.cx = 0;
+  free(words.entries);
+  words.entries = merged;
+  words.numentries = k;
+  words.cap = mergedcap;
+  pthread_mutex_unlock(&words.lock);
+
+  free(table);
 }
 
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+// Edits to many rows at once count between editorWordsBatchBegin() and
+// editorWordsBatchEnd(): one merge at the end instead of shifting the
+// sorted entries for every word that comes or goes. The counted text,
+// old and new, must stay in memory until the end.
+void editorWordsBatchBegin(void) {
+  if (!words.enabled) return;
+  words.batchcap = WORD_HASH_INITIAL;
+  words.batchused = 0;
+  words.batch = calloc(words.batchcap, sizeof(wordSlot));
+}
+
+void editorWordsBatchEnd(void) {
+  wordSlot *table = words.batch;
+  if (!table) return;
+  words.batch = NULL;
+  if (words.batchused >= WORD_BATCH_MERGE) {
+    wordsMergeTable(table, words.batchcap, 0);
+    return;
+  }
+  pthread_mutex_lock(&words.lock);
+  for (int i = 0; i < words.batchcap; i++) {
+    if (table[i].word && table[i].count) wordsAdjust(table[i].word, table[i].len, table[i].count);
   }
+  pthread_mutex_unlock(&words.lock);
+  free(table);
+}
 
-  erow *row = &E.row[E.cy];
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[E.cx + 1], &row->chars[E.cx], row->size - E.cx + 1);
-  row->size++;
-  row->chars[E.cx] = c;
-  E.cx++;
+static void *wordsBuildThread(void *arg) {
+  char *path = arg;
+  int fd = open(path, O_RDONLY);
+  free(path);
+  if (fd == -1) return NULL;
+
+  int cap = WORD_HASH_INITIAL, used = 0;
+  wordSlot *table = calloc(cap, sizeof(wordSlot));
+  char *buf = malloc(LOAD_CHUNK_SIZE + WORD_MAX_LEN);
+  int carry = 0; // a word cut off by the end of the previous chunk
+  ssize_t n;
+  while ((n = read(fd, buf + carry, LOAD_CHUNK_SIZE)) > 0) {
+    int len = carry + n;
+    int i = 0;
+    while (i < len) {
+      while (i < len && !isWordChar((unsigned char)buf[i])) i++;
+      int start = i;
+      while (i < len && isWordChar((unsigned char)buf[i])) i++;
+      if (i == len && start < len) {
+        carry = len - start;
+        if (carry > WORD_MAX_LEN) carry = 0; // too long to be indexed anyway
+        else memmove(buf, &buf[start], carry);
+        break;
+      }
+      carry = 0;
+      int wlen = i - start;
+      if (wlen >= WORD_MIN_LEN && wlen <= WORD_MAX_LEN) wordTableAdd(&table, &cap, &used, &buf[start], wlen, 1, 1);
+    }
+  }
+  if (carry >= WORD_MIN_LEN) wordTableAdd(&table, &cap, &used, buf, carry, 1, 1);
+  free(buf);
+  close(fd);
+
+  // Merge with whatever the edits have counted meanwhile
+  wordsMergeTable(table, cap, 1);
+  return NULL;
+}
+
+// Start tracking words; the counts for the file itself come from a
+// background pass over it.
+void editorWordsStart(void) {
+  if (E.viewer) return;
+  words.enabled = 1;
+  if (E.filename == NULL) return;
+
+  pthread_t tid;
+  char *path = strdup(E.filename);
+  if (pthread_create(&tid, NULL, wordsBuildThread, path) != 0) {
+    free(path);
+    return;
+  }
+  pthread_detach(tid);
+}
+
+/*********** diff gutter   *****************/
+
+// The gutter left of the line numbers marks rows added, modified or
+// deleted relative to a base version: the file as last loaded or saved,
+// or the blob at git HEAD. Each row remembers which base line it matches
+// (row->base, -1 if none). An edit only unmatches the rows it touches;
+// the window between the nearest still-matched rows above and below is
+// then re-diffed (Myers over 64-bit line hashes) on a worker thread and
+// the result applied if no further edit happened meanwhile. Rows keep
+// their hash until edited, so posting a window only rehashes those.
+
+#define DIFF_MAX_D 1000 // give up on an exact diff past this many edits
+
+enum diffMark {
+  DIFF_ADDED = 1,
+  DIFF_MODIFIED = 2,
+  DIFF_DELETED = 4 // base lines were deleted just above this row
+};
+
+typedef unsigned long long u64;
+
+typedef struct diffJob {
+  int gen;
+  unsigned long edits;
+  int first;       // current row of the window start
+  int base_first;  // base line of the window start
+  u64 *a;          // base hashes in the window
+  int n;
+  u64 *b;          // current hashes in the window
+  int m;
+  int *match;      // per current row: base line within the window or -1
+  int *delbefore;  // per current row (and one past): base lines deleted before it
+  struct diffState *owner; // buffer the job was posted for
+} diffJob;
+
+// One worker thread diffs for every buffer, a job at a time.
+static struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+  diffJob *job;       // waiting for or being run by the worker
+  diffJob *result;    // finished, waiting to be applied
+} diffWorker = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+};
+
+struct diffState {
+  int use_head;       // base is git HEAD instead of the saved file
+  u64 *base;          // hash of every base line
+  int nbase;
+  int capbase;
+  int gen;            // bumped whenever the base changes
+  int lo, hi;         // rows touched since the last diff, lo > hi if none
+  int deleted_at_end; // base lines deleted after the last row
+  int job_lo, job_hi; // rows covered by the job posted last
+  u64 *next;          // base read in the background, waiting to be taken over
+  int nnext;
+  int next_state;     // 0 idle, 1 reading, 2 ready, -1 failed
+  int next_head;      // the base being read is git HEAD, not the saved file
+  char *next_path;    // file the reader hashes or looks up in git
+};
+
+static struct diffState *diff; // of the active buffer
+
+static void diffStateInit(struct diffState *d) {
+  *d = (struct diffState){ .lo = INT_MAX, .hi = -1 };
+}
+
+u64 editorHashLine(const char *s, int len) {
+  u64 h = 14695981039346656037ULL;
+  for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+  return h;
+}
+
+// Hash of a row, kept with it until the row is changed.
+static u64 diffRowHash(erow *row) {
+  if (!row->hashed) {
+    row->hash = editorHashLine(row->chars, row->size);
+    row->hashed = 1;
+  }
+  return row->hash;
+}
+
+static void diffTouch(int lo, int hi) {
+  if (lo < diff->lo) diff->lo = lo;
+  if (hi > diff->hi) diff->hi = hi;
+}
+
+void editorDiffRowChanged(int at) {
+  E.row[at].hashed = 0;
+  if (!E.gutter) return;
+  E.row[at].base = -1;
+  E.row[at].diff = DIFF_MODIFIED;
+  diffTouch(at, at);
+}
+
+void editorDiffRowInserted(int at) {
+  E.row[at].hashed = 0;
+  E.row[at].base = -1;
+  E.row[at].diff = DIFF_ADDED;
+  if (!E.gutter) return;
+  if (diff->hi >= at) diff->hi++;
+  diffTouch(at, at);
+}
+
+void editorDiffRowDeleted(int at) {
+  if (!E.gutter) return;
+  if (diff->hi > at) diff->hi--;
+  if (at < E.numrows) E.row[at].diff |= DIFF_DELETED;
+  diffTouch(at, at);
+}
+
+static int diffPushBase(u64 hash) {
+  if (diff->nbase == diff->capbase) {
+    diff->capbase = diff->capbase ? diff->capbase * 2 : 4096;
+    diff->base = realloc(diff->base, sizeof(u64) * diff->capbase);
+  }
+  diff->base[diff->nbase] = hash;
+  return diff->nbase++;
+}
+
+// Row `at` was just read from the file (by the loader or follow mode),
+// so it is part of the saved version as it is.
+void editorDiffLoadedRow(int at, u64 hash) {
+  erow *row = &E.row[at];
+  row->hash = hash;
+  row->hashed = 1;
+  if (diff->use_head) {
+    row->base = -1;
+    row->diff = DIFF_ADDED;
+    if (E.gutter) diffTouch(at, at);
+    return;
+  }
+  row->base = diffPushBase(hash);
+  row->diff = 0;
+}
+
+// The last row, left without a newline, grew from the file.
+void editorDiffLoadedRowGrew(int at) {
+  erow *row = &E.row[at];
+  row->hashed = 0;
+  if (!diff->use_head && row->base >= 0 && row->base == diff->nbase - 1) {
+    diff->base[row->base] = diffRowHash(row);
+  } else {
+    editorDiffRowChanged(at);
+  }
+}
+
+// Hash every line read from fd; returns the number of lines.
+static int diffHashLines(int fd, u64 **hashes) {
+  struct abuf line = ABUF_INIT;
+  char *buf = malloc(LOAD_CHUNK_SIZE);
+  int n = 0, cap = 0;
+  ssize_t got;
+  *hashes = NULL;
+  while ((got = read(fd, buf, LOAD_CHUNK_SIZE)) > 0) {
+    char *p = buf, *end = buf + got, *nl;
+    while (p < end) {
+      nl = memchr(p, '\n', end - p);
+      abAppend(&line, p, (nl ? nl : end) - p);
+      if (!nl) break;
+      int len = line.len;
+      while (len > 0 && line.b[len - 1] == '\r') len--;
+      if (n == cap) {
+        cap = cap ? cap * 2 : 4096;
+        *hashes = realloc(*hashes, sizeof(u64) * cap);
+      }
+      (*hashes)[n++] = editorHashLine(line.b, len);
+      line.len = 0;
+      p = nl + 1;
+    }
+  }
+  if (line.len > 0) {
+    *hashes = realloc(*hashes, sizeof(u64) * (n + 1));
+    (*hashes)[n++] = editorHashLine(line.b, line.len);
+  }
+  abFree(&line);
+  free(buf);
+  return n;
+}
+
+// Myers' O((N+M)D) diff of a[0..n) against b[0..m). Fills match[] and
+// delbefore[] (see diffJob) and returns 0, or -1 if the edit distance
+// is above maxd.
+static int diffMyers(const u64 *a, int n, const u64 *b, int m, int *match, int *delbefore, int maxd) {
+  int off = maxd + 1;
+  int *v = calloc(2 * maxd + 3, sizeof(int));
+  int **trace = malloc(sizeof(int *) * (maxd + 1));
+  int found = -1;
+
+  for (int d = 0; d <= maxd && found == -1; d++) {
+    for (int k = -d; k <= d; k += 2) {
+      int x;
+      if (k == -d || (k != d && v[off + k - 1] < v[off + k + 1])) x = v[off + k + 1];
+      else x = v[off + k - 1] + 1;
+      int y = x - k;
+      while (x < n && y < m && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      v[off + k] = x;
+      if (x >= n && y >= m) found = d;
+    }
+    trace[d] = malloc(sizeof(int) * (2 * d + 1));
+    memcpy(trace[d], &v[off - d], sizeof(int) * (2 * d + 1));
+  }
+  free(v);
+  if (found == -1) {
+    for (int d = 0; d <= maxd; d++) free(trace[d]);
+    free(trace);
+    return -1;
+  }
+
+  int x = n, y = m;
+  for (int d = found; d > 0; d--) {
+    int *vp = trace[d - 1];
+    int k = x - y;
+    int prev_k;
+    if (k == -d || (k != d && vp[k - 1 + d - 1] < vp[k + 1 + d - 1])) prev_k = k + 1;
+    else prev_k = k - 1;
+    int prev_x = vp[prev_k + d - 1];
+    int prev_y = prev_x - prev_k;
+    while (x > prev_x && y > prev_y) {
+      x--;
+      y--;
+      match[y] = x;
+    }
+    if (prev_k == k + 1) match[prev_y] = -1;  // b[prev_y] was added
+    else delbefore[prev_y]++;                 // a[prev_x] was deleted
+    x = prev_x;
+    y = prev_y;
+  }
+  while (x > 0 && y > 0) {
+    x--;
+    y--;
+    match[y] = x;
+  }
+  for (int d = 0; d <= found; d++) free(trace[d]);
+  free(trace);
+  return 0;
+}
+
+static void diffRunJob(diffJob *job) {
+  int n = job->n, m = job->m;
+  for (int j = 0; j <= m; j++) job->delbefore[j] = 0;
+
+  // Common prefix and suffix need no search
+  int pre = 0;
+  while (pre < n && pre < m && job->a[pre] == job->b[pre]) {
+    job->match[pre] = pre;
+    pre++;
+  }
+  int suf = 0;
+  while (suf < n - pre && suf < m - pre && job->a[n - 1 - suf] == job->b[m - 1 - suf]) {
+    job->match[m - 1 - suf] = n - 1 - suf;
+    suf++;
+  }
+
+  int cn = n - pre - suf, cm = m - pre - suf;
+  int *match = &job->match[pre];
+  int *delbefore = &job->delbefore[pre];
+  if (diffMyers(&job->a[pre], cn, &job->b[pre], cm, match, delbefore, DIFF_MAX_D) == -1) {
+    // Too different to be worth aligning: pair the lines up by position
+    for (int j = 0; j < cm; j++) {
+      if (j < cn && job->a[pre + j] == job->b[pre + j]) {
+        match[j] = j;
+      } else {
+        match[j] = -1;
+        if (j < cn) delbefore[j]++;
+      }
+    }
+    if (cn > cm) delbefore[cm] += cn - cm;
+  }
+  for (int j = 0; j < cm; j++) {
+    if (match[j] >= 0) match[j] += pre;
+  }
+}
+
+static void *diffThread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&diffWorker.lock);
+  while (1) {
+    while (diffWorker.job == NULL || diffWorker.result != NULL) pthread_cond_wait(&diffWorker.cond, &diffWorker.lock);
+    diffJob *job = diffWorker.job;
+    pthread_mutex_unlock(&diffWorker.lock);
+
+    diffRunJob(job);
+
+    pthread_mutex_lock(&diffWorker.lock);
+    diffWorker.job = NULL;
+    diffWorker.result = job;
+  }
+  return NULL;
+}
+
+static void diffFreeJob(diffJob *job) {
+  free(job->a);
+  free(job->b);
+  free(job->match);
+  free(job->delbefore);
+  free(job);
+}
+
+// Mark rows job->first .. job->first + job->m - 1 and the row after them.
+static void diffApplyJob(diffJob *job) {
+  int m = job->m;
+  int j = 0;
+  while (j < m) {
+    int at = job->first + j;
+    if (job->match[j] >= 0) {
+      E.row[at].base = job->base_first + job->match[j];
+      E.row[at].diff = job->delbefore[j] ? DIFF_DELETED : 0;
+      j++;
+      continue;
+    }
+    // A run of unmatched rows is a hunk; with deletions in it, the rows
+    // were modified rather than added.
+    int end = j;
+    int dels = 0;
+    while (end < m && job->match[end] < 0) dels += job->delbefore[end++];
+    dels += job->delbefore[end];
+    for (int r = j; r < end; r++) {
+      E.row[job->first + r].base = -1;
+      E.row[job->first + r].diff = dels ? DIFF_MODIFIED : DIFF_ADDED;
+    }
+    if (end < m) job->delbefore[end] = 0; // accounted for by the hunk
+    else job->delbefore[m] = 0;
+    j = end;
+  }
+
+  int after = job->first + m;
+  editorViewsDamage(job->first, after);
+  if (after < E.numrows) {
+    E.row[after].diff &= ~DIFF_DELETED;
+    if (job->delbefore[m]) E.row[after].diff |= DIFF_DELETED;
+  } else {
+    diff->deleted_at_end = job->delbefore[m] > 0;
+  }
+}
+
+static void diffPostJob(void) {
+  int lo = diff->lo < E.numrows ? diff->lo : E.numrows;
+  int hi = diff->hi < E.numrows ? diff->hi : E.numrows - 1;
+  diff->lo = INT_MAX;
+  diff->hi = -1;
+
+  // Grow the window to the nearest matched rows; those bound it in the
+  // base too.
+  int first = lo;
+  while (first > 0 && E.row[first - 1].base < 0) first--;
+  int last = hi;
+  while (last + 1 < E.numrows && E.row[last + 1].base < 0) last++;
+  if (last < first - 1) last = first - 1;
+  int base_first = first > 0 ? E.row[first - 1].base + 1 : 0;
+  int base_end = last + 1 < E.numrows ? E.row[last + 1].base : diff->nbase;
+  if (base_end < base_first) base_end = base_first;
+
+  diffJob *job = malloc(sizeof(diffJob));
+  job->gen = diff->gen;
+  job->edits = E.edits;
+  job->first = first;
+  job->base_first = base_first;
+  job->n = base_end - base_first;
+  job->m = last - first + 1;
+  job->a = malloc(sizeof(u64) * (job->n + 1));
+  memcpy(job->a, &diff->base[base_first], sizeof(u64) * job->n);
+  job->b = malloc(sizeof(u64) * (job->m + 1));
+  for (int j = 0; j < job->m; j++) job->b[j] = diffRowHash(&E.row[first + j]);
+  job->match = malloc(sizeof(int) * (job->m + 1));
+  job->delbefore = malloc(sizeof(int) * (job->m + 1));
+  job->owner = diff;
+  diff->job_lo = first;
+  diff->job_hi = last;
+
+  pthread_mutex_lock(&diffWorker.lock);
+  diffWorker.job = job;
+  pthread_cond_signal(&diffWorker.cond);
+  pthread_mutex_unlock(&diffWorker.lock);
+}
+
+// Make every row a candidate for the next diff against a new base.
+static void diffUnmatchAll(void) {
+  for (int i = 0; i < E.numrows; i++) E.row[i].base = -1;
+  diff->gen++;
+  diff->lo = 0;
+  diff->hi = E.numrows - 1;
+}
+
+// Hashes the saved file, or its HEAD version read through git, off the
+// main thread.
+static void *diffBaseThread(void *arg) {
+  struct diffState *d = arg;
+  char *path = d->next_path;
+  u64 *hashes = NULL;
+  int n = 0;
+  int ok = 0;
+
+  if (!d->next_head) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    struct stat st;
+    if (fd == -1) {
+      ok = errno == ENOENT; // gone from disk: every row is new
+    } else {
+      if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        n = diffHashLines(fd, &hashes);
+        ok = 1;
+      }
+      close(fd);
+    }
+  } else {
+    char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+    size_t speclen = strlen(path) + 16;
+    char *spec = malloc(speclen);
+    snprintf(spec, speclen, "HEAD:./%s", slash ? slash + 1 : path);
+
+    int fds[2];
+    if (pipe(fds) == 0) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        int devnull = open("/dev/null", O_RDWR);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        dup2(devnull, STDIN_FILENO);
+        close(fds[0]);
+        execlp("git", "git", "-C", dir, "show", spec, (char *)NULL);
+        _exit(127);
+      }
+      close(fds[1]);
+      if (pid > 0) {
+        n = diffHashLines(fds[0], &hashes);
+        int status;
+        ok = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      }
+      close(fds[0]);
+    }
+    free(dir);
+    free(spec);
+  }
+
+  pthread_mutex_lock(&diffWorker.lock);
+  free(d->next_path);
+  d->next_path = NULL;
+  if (ok) {
+    d->next = hashes;
+    d->nnext = n;
+    d->next_state = 2;
+  } else {
+    free(hashes);
+    d->next_state = -1;
+  }
+  pthread_mutex_unlock(&diffWorker.lock);
+  return NULL;
+}
+
+// Switch the base between the saved file and git HEAD.
+void editorDiffToggleBase(void) {
+  if (!E.gutter) return;
+  pthread_mutex_lock(&diffWorker.lock);
+  int busy = diff->next_state == 1;
+  pthread_mutex_unlock(&diffWorker.lock);
+  if (busy) return;
+
+  const u64 *lines;
+  int n = diff->use_head ? editorDiskLines(&lines) : -1;
+  if (n >= 0) {
+    // The saved version is still hashed to notice changes on disk
+    if (n > diff->capbase) {
+      diff->capbase = n;
+      diff->base = realloc(diff->base, sizeof(u64) * diff->capbase);
+    }
+    memcpy(diff->base, lines, sizeof(u64) * n);
+    diff->nbase = n;
+    diff->use_head = 0;
+    diffUnmatchAll();
+    editorSetStatusMessage("Diff against the saved file");
+    return;
+  }
+
+  if (E.filename == NULL) {
+    editorSetStatusMessage("No file to look up in git");
+    return;
+  }
+  pthread_t tid;
+  diff->next_head = !diff->use_head;
+  diff->next_path = strdup(E.filename);
+  diff->next_state = 1;
+  if (pthread_create(&tid, NULL, diffBaseThread, diff) != 0) {
+    free(diff->next_path);
+    diff->next_path = NULL;
+    diff->next_state = 0;
+    return;
+  }
+  pthread_detach(tid);
+  editorSetStatusMessage(diff->next_head ? "Reading git HEAD..." : "Reading the saved file...");
+}
+
+// The buffer was just written out; with the saved file as base, every
+// row matches itself again.
+void editorDiffSaved(void) {
+  if (!E.gutter || diff->use_head) return;
+  diff->nbase = 0;
+  diff->gen++;
+  for (int i = 0; i < E.numrows; i++) {
+    E.row[i].base = diffPushBase(diffRowHash(&E.row[i]));
+    E.row[i].diff = 0;
+  }
+  diff->deleted_at_end = 0;
+  diff->lo = INT_MAX;
+  diff->hi = -1;
+  editorViewsDamage(0, INT_MAX);
+}
+
+int editorDiffPoll(void) {
+  if (!E.gutter) return 0;
+  int changed = 0;
+
+  pthread_mutex_lock(&diffWorker.lock);
+  diffJob *result = diffWorker.result;
+  diffWorker.result = NULL;
+  int busy = diffWorker.job != NULL;
+  int next_state = diff->next_state;
+  if (next_state == 2 || next_state == -1) diff->next_state = 0;
+  pthread_mutex_unlock(&diffWorker.lock);
+
+  if (next_state == 2) {
+    free(diff->base);
+    diff->base = diff->next;
+    diff->nbase = diff->capbase = diff->nnext;
+    diff->next = NULL;
+    diff->use_head = diff->next_head;
+    diffUnmatchAll();
+    editorSetStatusMessage(diff->use_head ? "Diff against git HEAD" : "Diff against the saved file");
+    changed = 1;
+  } else if (next_state == -1) {
+    editorSetStatusMessage(diff->next_head ? "Can't read %s from git HEAD" : "Can't read %s", E.filename);
+    changed = 1;
+  }
+
+  if (result && result->owner != diff) {
+    // Posted by a buffer that is no longer active: it redoes the job
+    // when it is switched back to
+    struct diffState *d = result->owner;
+    if (d->job_lo < d->lo) d->lo = d->job_lo;
+    if (d->job_hi > d->hi) d->hi = d->job_hi;
+    diffFreeJob(result);
+    pthread_cond_signal(&diffWorker.cond);
+  } else if (result) {
+    if (result->gen == diff->gen && result->edits == E.edits) {
+      diffApplyJob(result);
+      changed = 1;
+    } else {
+      diffTouch(diff->job_lo, diff->job_hi); // overtaken by edits, redo
+    }
+    diffFreeJob(result);
+    pthread_cond_signal(&diffWorker.cond);
+  }
+
+  if (!busy && diff->lo <= diff->hi && !E.loading) diffPostJob();
+  return changed;
+}
+
+void editorDiffStart(void) {
+  if (E.viewer) return;
+  if (!diffWorker.running) {
+    if (pthread_create(&diffWorker.thread, NULL, diffThread, NULL) != 0) return;
+    pthread_detach(diffWorker.thread);
+    diffWorker.running = 1;
+  }
+  E.gutter = 1;
+}
+
+// The file changed on disk; with the saved file as base, diff against
+// its new contents from scratch.
+void editorDiffDiskChanged(const u64 *hashes, int n) {
+  if (!E.gutter || diff->use_head) return;
+  if (n > diff->capbase) {
+    diff->capbase = n;
+    diff->base = realloc(diff->base, sizeof(u64) * diff->capbase);
+  }
+  memcpy(diff->base, hashes, sizeof(u64) * n);
+  diff->nbase = n;
+  diff->deleted_at_end = 0;
+  diffUnmatchAll();
+}
+
+// Gutter marker for row at (or for the filler line after the last row).
+const char *editorDiffMarker(int at) {
+  if (at >= E.numrows) return at == E.numrows && diff->deleted_at_end ? "\x1b[31m_\x1b[m" : " ";
+  unsigned char d = E.row[at].diff;
+  if (d & DIFF_MODIFIED) return "\x1b[33m~\x1b[m";
+  if (d & DIFF_ADDED) return "\x1b[32m+\x1b[m";
+  if (d & DIFF_DELETED) return "\x1b[31m_\x1b[m";
+  return " ";
+}
+
+/*********** external changes *****************/
+
+// The file is stat()ed every DISK_CHECK_MS (and right before a save) to
+// notice other programs rewriting it. The hash of every line as last read
+// or written is kept, so a change is merged in three ways: the new
+// contents are diffed against that version to find the hunks that
+// changed on disk, the buffer is diffed against it to find the rows
+// edited here, and only hunks whose lines are untouched in the buffer are
+// replaced. Everything else, cursor and selection included, stays as is.
+
+#define DISK_CHECK_MS 1000
+
+struct diskState {
+  int known;           // st and lines describe the file, checks are on
+  struct stat st;      // of the file as last read or written
+  u64 *lines;          // hash of every line of that version
+  int nlines;
+  int cap;
+  unsigned long edits; // E.edits when the buffer last matched lines[], else ULONG_MAX
+  long long last_check;
+};
+
+static struct diskState *disk; // of the active buffer
+
+void editorDiskOpened(const struct stat *st) {
+  disk->known = 1;
+  disk->st = *st;
+  disk->nlines = 0;
+  disk->edits = E.edits;
+  disk->last_check = monotonicMs();
+}
+
+void editorDiskLoadedRow(u64 hash) {
+  if (!disk->known) return;
+  if (disk->nlines == disk->cap) {
+    disk->cap = disk->cap ? disk->cap * 2 : 4096;
+    disk->lines = realloc(disk->lines, sizeof(u64) * disk->cap);
+  }
+  disk->lines[disk->nlines++] = hash;
+}
+
+// The last line, read without its newline, grew from the file.
+void editorDiskLoadedRowGrew(u64 hash) {
+  if (disk->nlines > 0) disk->lines[disk->nlines - 1] = hash;
+}
+
+// Hashes of the saved version, or -1 if they are not tracked (a pipe, a
+// file that did not exist yet).
+int editorDiskLines(const u64 **lines) {
+  if (!disk->known) return -1;
+  *lines = disk->lines;
+  return disk->nlines;
+}
+
+// Follow mode consumed the file up to st.
+void editorDiskFollowed(const struct stat *st) {
+  if (disk->known) disk->st = *st;
+}
+
+void editorDiskSaved(void) {
+  if (!disk->known || stat(E.filename, &disk->st) == -1) return;
+  if (E.numrows > disk->cap) {
+    disk->cap = E.numrows;
+    disk->lines = realloc(disk->lines, sizeof(u64) * disk->cap);
+  }
+  for (int i = 0; i < E.numrows; i++) disk->lines[i] = diffRowHash(&E.row[i]);
+  disk->nlines = E.numrows;
+  disk->edits = E.edits;
+}
+
+static int diskChanged(const struct stat *st) {
+  return st->st_size != disk->st.st_size || st->st_ino != disk->st.st_ino ||
+    st->st_mtim.tv_sec != disk->st.st_mtim.tv_sec ||
+    st->st_mtim.tv_nsec != disk->st.st_mtim.tv_nsec;
+}
+
+// Diff a[0..n) against b[0..m) with the gutter's machinery; the caller
+// owns the returned job and its match[] and delbefore[].
+static diffJob *diskDiff(u64 *a, int n, u64 *b, int m) {
+  diffJob *job = calloc(1, sizeof(diffJob));
+  job->a = a;
+  job->n = n;
+  job->b = b;
+  job->m = m;
+  job->match = malloc(sizeof(int) * (m + 1));
+  job->delbefore = malloc(sizeof(int) * (m + 1));
+  diffRunJob(job);
+  return job;
+}
+
+// Move a row position across a hunk at `at` that replaced `del` rows by
+// `ins` rows.
+static int diskShiftRow(int y, int at, int del, int ins) {
+  if (y >= at + del) return y + ins - del;
+  if (y >= at) return at;
+  return y;
+}
+
+// Merge the new contents of the file into the buffer. Sets *merged and
+// *conflicts to the number of hunks taken over and left alone.
+static int diskMerge(int fd, const struct stat *st, int *merged, int *conflicts) {
+  struct abuf text = ABUF_INIT;
+  char *buf = malloc(LOAD_CHUNK_SIZE);
+  ssize_t got;
+  while ((got = read(fd, buf, LOAD_CHUNK_SIZE)) > 0) abAppend(&text, buf, got);
+  free(buf);
+  if (got == -1) {
+    abFree(&text);
+    return -1;
+  }
+
+  // Split the new version into lines the way the loader does
+  int nnew = 0, cap = 0;
+  int *start = NULL, *len = NULL;
+  u64 *hash = NULL;
+  for (int p = 0; p < text.len; ) {
+    char *nl = memchr(text.b + p, '\n', text.len - p);
+    int end = nl ? nl - text.b : text.len;
+    int l = end - p;
+    while (l > 0 && (text.b[p + l - 1] == '\r' || text.b[p + l - 1] == '\n')) l--;
+    if (nnew == cap) {
+      cap = cap ? cap * 2 : 4096;
+      start = realloc(start, sizeof(int) * cap);
+      len = realloc(len, sizeof(int) * cap);
+      hash = realloc(hash, sizeof(u64) * cap);
+    }
+    start[nnew] = p;
+    len[nnew] = l;
+    hash[nnew++] = editorHashLine(text.b + p, l);
+    p = end + 1;
+  }
+
+  // old line -> new line, and old line -> buffer row (-1 where changed)
+  int nold = disk->nlines;
+  int *newof = malloc(sizeof(int) * (nold + 1));
+  int *rowof = malloc(sizeof(int) * (nold + 1));
+  for (int i = 0; i < nold; i++) newof[i] = rowof[i] = -1;
+  diffJob *ext = diskDiff(disk->lines, nold, hash, nnew);
+  for (int j = 0; j < nnew; j++) {
+    if (ext->match[j] >= 0) newof[ext->match[j]] = j;
+  }
+  if (disk->edits == E.edits && E.numrows == nold) {
+    for (int i = 0; i < nold; i++) rowof[i] = i;
+  } else {
+    u64 *cur = malloc(sizeof(u64) * (E.numrows + 1));
+    for (int i = 0; i < E.numrows; i++) cur[i] = diffRowHash(&E.row[i]);
+    diffJob *local = diskDiff(disk->lines, nold, cur, E.numrows);
+    for (int j = 0; j < E.numrows; j++) {
+      if (local->match[j] >= 0) rowof[local->match[j]] = j;
+    }
+    local->a = NULL;
+    diffFreeJob(local);
+  }
+  ext->a = ext->b = NULL;
+  diffFreeJob(ext);
+
+  // Walk the hunks bottom up so row numbers above stay valid. A hunk
+  // replaces old lines [i0, i1) by new lines [j0, j1).
+  *merged = *conflicts = 0;
+  int i1 = nold, j1 = nnew;
+  while (i1 > 0 || j1 > 0) {
+    int i0 = i1, j0 = j1;
+    while (i0 > 0 && newof[i0 - 1] == -1) i0--;
+    j0 = i0 > 0 ? newof[i0 - 1] + 1 : 0;
+    if (i0 == i1 && j0 == j1) {
+      // Unchanged line, step over it
+      i1--;
+      j1--;
+      continue;
+    }
+
+    // Where the hunk goes in the buffer: its old lines must all still be
+    // there, unedited and in one piece
+    int at = -1;
+    int ok = 1;
+    if (i1 > i0) {
+      at = rowof[i0];
+      for (int i = i0; i < i1 && ok; i++) ok = rowof[i] >= 0 && rowof[i] == at + (i - i0);
+    } else if (i0 < nold && rowof[i0] >= 0) {
+      at = rowof[i0];
+    } else if (i0 > 0 && rowof[i0 - 1] >= 0) {
+      at = rowof[i0 - 1] + 1;
+    } else if (nold == 0) {
+      at = E.numrows;
+    }
+    if (!ok || at < 0) {
+      (*conflicts)++;
+    } else {
+      int del = i1 - i0, ins = j1 - j0;
+      for (int k = 0; k < del; k++) editorDelRow(at);
+      for (int k = 0; k < ins; k++) editorInsertRow(at + k, text.b + start[j0 + k], len[j0 + k]);
+      E.cy = diskShiftRow(E.cy, at, del, ins);
+      E.rowoff = diskShiftRow(E.rowoff, at, del, ins);
+      if (E.selecting) E.sel_start_y = diskShiftRow(E.sel_start_y, at, del, ins);
+      (*merged)++;
+    }
+    i1 = i0;
+    j1 = j0;
+  }
+  free(newof);
+  free(rowof);
+  abFree(&text);
+  free(start);
+  free(len);
+
+  // The new version is what the buffer is now measured against
+  free(disk->lines);
+  disk->lines = hash;
+  disk->nlines = disk->cap = nnew;
+  disk->st = *st;
+  editorDiffDiskChanged(hash, nnew);
+
+  // The journal applies to the new version from here on: restart it
+  // with whatever edits the buffer still has on top of that version.
+  editorJournalReset();
+  u64 *cur = malloc(sizeof(u64) * (E.numrows + 1));
+  for (int i = 0; i < E.numrows; i++) cur[i] = diffRowHash(&E.row[i]);
+  diffJob *rest = diskDiff(disk->lines, nnew, cur, E.numrows);
+  int edited = 0;
+  for (int j = 0; j <= E.numrows; j++) {
+    for (int k = 0; k < rest->delbefore[j]; k++) editorJournalRecord(J_DELETE_ROW, j, 0, NULL, 0);
+    edited |= rest->delbefore[j];
+    if (j < E.numrows && rest->match[j] < 0) {
+      editorJournalRecord(J_INSERT_ROW, j, 0, E.row[j].chars, E.row[j].size);
+      edited = 1;
+    }
+  }
+  rest->a = NULL;
+  diffFreeJob(rest);
+  disk->edits = edited ? ULONG_MAX : E.edits;
+
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  int rowlen = E.cy < E.numrows ? E.row[E.cy].size : 0;
+  if (E.cx > rowlen) E.cx = rowlen;
+  return 0;
 }
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
+// Look at the file now; returns 1 if it changed on disk and the change
+// was merged into the buffer.
+static int diskCheck(void) {
+  disk->last_check = monotonicMs();
+  struct stat st;
+  if (stat(E.filename, &st) == -1 || !diskChanged(&st)) return 0;
+
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1) return 0;
+  fstat(fd, &st);
+  int merged, conflicts;
+  int err = diskMerge(fd, &st, &merged, &conflicts);
+  close(fd);
+  if (err) {
+    // Seen, so a file that can't be read doesn't block every save
+    disk->st = st;
+    editorSetStatusMessage("File changed on disk, can't read it: %s", strerror(errno));
+    return 1;
+  }
+  if (conflicts) {
+    editorSetStatusMessage("File changed on disk: %d hunks reloaded, %d kept as edited here",
+      merged, conflicts);
+  } else if (merged) {
+    editorSetStatusMessage("File changed on disk: %d hunks reloaded", merged);
+  }
+  return merged + conflicts > 0;
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  free(E.row[at].chars);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
+int editorDiskPoll(void) {
+  if (!disk->known || E.loading || E.viewer || E.follow) return 0;
+  if (monotonicMs() - disk->last_check < DISK_CHECK_MS) return 0;
+  return diskCheck();
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
+// Called before writing the file: returns 0 if the save may go ahead.
+// A change found on disk is merged first and the save refused, so the
+// merged buffer can be looked at before it overwrites the file. The merge
+// records what it read, so the next save goes ahead unless the file
+// changed yet again.
+int editorDiskBeforeSave(void) {
+  if (!disk->known || E.viewer || E.follow) return 0;
+  if (!diskCheck()) return 0;
+  editorSetStatusMessage("File changed on disk and was merged in, Ctrl-S again to save");
+  return -1;
 }
 
-void editorDelChar(void) {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
+/*********** buffers   *****************/
 
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    // Normal character deletion
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    // At beginning of line - join with previous line
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
-  }
+// Every file named on the command line gets a buffer, opened the first
+// time it is switched to, so naming many files costs next to nothing
+// until they are looked at. The active buffer lives where the rest of the
+// editor expects it: rows and cursor in E, and the per-file state of each
+// module behind its lineindex, loader, viewer, follow, journal, diff and
+// disk pointer. Switching parks E in the buffer it belonged to and aims
+// those pointers at the next buffer, so it takes a struct copy whatever
+// the size of the files. Threads hold on to the state of their own
+// buffer: a parked file keeps loading and its journal keeps flushing, and
+// what they produced is picked up once it is switched back to.
+
+typedef struct editorBuffer {
+  char *path;             // as named on the command line, "-" for stdin
+  int opened;
+  struct editorConfig E;  // while parked
+  struct lineIndex lineindex;
+  struct loaderState loader;
+  struct viewerState viewer;
+  struct followState follow;
+  struct journalState journal;
+  struct diffState diff;
+  struct diskState disk;
+  struct viewsState views;
+} editorBuffer;
+
+static struct {
+  editorBuffer **list;
+  int num;
+  int cur;     // -1 before the first switch
+  int viewer;  // -R and -f apply to every file
+  int follow;
+  int started; // errors go to the status bar rather than end the editor
+} buffers = { .cur = -1 };
+
+void editorBufferAdd(const char *path) {
+  editorBuffer *b = calloc(1, sizeof(editorBuffer));
+  b->path = path ? strdup(path) : NULL;
+  loaderStateInit(&b->loader);
+  viewerStateInit(&b->viewer);
+  followStateInit(&b->follow);
+  journalStateInit(&b->journal);
+  diffStateInit(&b->diff);
+  viewsStateInit(&b->views);
+  buffers.list = realloc(buffers.list, sizeof(editorBuffer *) * (buffers.num + 1));
+  buffers.list[buffers.num++] = b;
 }
 
-char *editorGetSelection(size_t *buflen) {
-    if (!E.selecting) return NULL;
+// The per-file part of E for a buffer that has not been opened yet.
+static void bufferResetConfig(void) {
+  E.cx = 0;
+  E.cy = 0;
+  E.rowoff = 0;
+  E.coloff = 0;
+  E.numrows = 0;
+  E.row = NULL;
+  E.filename = NULL;
+  E.sel_start_x = -1;
+  E.sel_start_y = -1;
+  E.selecting = 0;
+  E.block = 0;
+  E.cursors = NULL;
+  E.ncursors = 0;
+  E.edits = 0;
+  E.loading = 0;
+  E.viewer = buffers.viewer;
+  E.follow = 0;
+  E.gutter = 0;
+  E.undo.rows = NULL;
+  E.undo.numrows = 0;
+}
 
-    int start_y, start_x, end_y, end_x;
-    if (E.sel_start_y < E.cy || (E.sel_start_y == E.cy && E.sel_start_x <= E.cx)) {
-        start_y = E.sel_start_y;
-        start_x = E.sel_start_x;
-        end_y = E.cy;
-        end_x = E.cx;
-    } else {
-        start_y = E.cy;
-        start_x = E.cx;
-        end_y = E.sel_start_y;
-        end_x = E.sel_start_x;
-    }
+// Bring in a parked buffer's E; the screen size, the message line, the
+// search highlight and the clipboard are shared by all buffers.
+static void bufferLoadConfig(const struct editorConfig *c) {
+  struct editorConfig keep = E;
+  E = *c;
+  E.screenrows = keep.screenrows;
+  E.screencols = keep.screencols;
+  E.termrows = keep.termrows;
+  E.termcols = keep.termcols;
+  memcpy(E.statusmsg, keep.statusmsg, sizeof(E.statusmsg));
+  E.statusmsg_time = keep.statusmsg_time;
+  E.highlight_query = keep.highlight_query;
+  E.clipboard = keep.clipboard;
+  E.orig_termios = keep.orig_termios;
+}
 
-    if (start_y < 0 || end_y >= E.numrows) return NULL;
+static int memoryLow(void) {
+  long avail = sysconf(_SC_AVPHYS_PAGES);
+  long total = sysconf(_SC_PHYS_PAGES);
+  return avail > 0 && total > 0 && avail < total / 8;
+}
 
-    struct abuf ab = ABUF_INIT;
+void editorBufferSwitch(int i) {
+  if (i < 0 || i >= buffers.num || i == buffers.cur) return;
+  if (buffers.cur >= 0) buffers.list[buffers.cur]->E = E;
 
-    if (start_y == end_y) {
-        erow *row = &E.row[start_y];
-        if (start_x >= row->size || start_x >= end_x) {
-             abFree(&ab);
-             return NULL;
-        }
-        int len = end_x - start_x;
-        if (len > row->size - start_x) len = row->size - start_x;
-        abAppend(&ab, &row->chars[start_x], len);
-    } else {
-        erow *row = &E.row[start_y];
-        int len = row->size - start_x;
-        if (len > 0) abAppend(&ab, &row->chars[start_x], len);
-        abAppend(&ab, "\n", 1);
+  editorBuffer *b = buffers.list[i];
+  if (b->opened) bufferLoadConfig(&b->E);
+  else bufferResetConfig();
+  lineindex = &b->lineindex;
+  loader = &b->loader;
+  viewer = &b->viewer;
+  follow = &b->follow;
+  journal = &b->journal;
+  diff = &b->diff;
+  disk = &b->disk;
+  views = &b->views;
+  buffers.cur = i;
+  viewSize(&views->list[views->cur]);
+  editorViewsInvalidate(); // the screen still shows the last buffer
 
-        for (int i = start_y + 1; i < end_y; i++) {
-            row = &E.row[i];
-            abAppend(&ab, row->chars, row->size);
-            abAppend(&ab, "\n", 1);
-        }
+  if (!b->opened) {
+    b->opened = 1;
+    if (b->path) {
+      if (editorOpen(b->path) == -1) {
+        if (!buffers.started) die("open");
+        editorSetStatusMessage("Can't open %s: %s", b->path, strerror(errno));
+      } else if (buffers.follow) {
+        editorFollowStart();
+      }
+      editorJournalOpen();
+    }
+    editorWordsStart();
+    editorDiffStart();
+  } else {
+    disk->last_check = 0; // the file may have changed while it was parked
+  }
 
-        row = &E.row[end_y];
-        if (end_x > 0) {
-             if (end_x > row->size) end_x = row->size;
-             abAppend(&ab, row->chars, end_x);
-        }
+  // Parked buffers can do without their decoded viewer pages
+  if (memoryLow()) {
+    for (int j = 0; j < buffers.num; j++) {
+      if (j != i && buffers.list[j]->opened) viewerDropCache(&buffers.list[j]->viewer);
     }
-    
-    if (buflen) *buflen = ab.len;
-    return ab.b;
+  }
 }
 
-void editorDeleteSelection(void) {
-    if (!E.selecting) return;
+// Index of the active buffer; *count is set to the number of buffers.
+int editorBufferIndex(int *count) {
+  *count = buffers.num;
+  return buffers.cur;
+}
 
-    int start_y, start_x, end_y, end_x;
-    if (E.sel_start_y < E.cy || (E.sel_start_y == E.cy && E.sel_start_x <= E.cx)) {
-        start_y = E.sel_start_y;
-        start_x = E.sel_start_x;
-        end_y = E.cy;
-        end_x = E.cx;
-    } else {
-        start_y = E.cy;
-        start_x = E.cx;
-        end_y = E.sel_start_y;
-        end_x = E.sel_start_x;
-    }
-    
-    if (start_y < 0 || end_y >= E.numrows) return;
+// On the way out: close the journal of every buffer and remember where
+// its cursor was.
+void editorBufferCloseAll(void) {
+  for (int i = 0; i < buffers.num; i++) {
+    if (!buffers.list[i]->opened) continue;
+    editorBufferSwitch(i);
+    editorJournalClose(1);
+    editorIndexSavePosition();
+  }
+}
 
-    if (start_y == end_y) {
-        erow *row = &E.row[start_y];
-        if (start_x >= row->size || start_x >= end_x) return;
-        int len = end_x - start_x;
-        if (len > row->size - start_x) len = row->size - start_x;
-        
-        memmove(&row->chars[start_x], &row->chars[start_x + len], row->size - start_x - len + 1);
-        row->size -= len;
-    } else {
-        erow *first_row = &E.row[start_y];
-        erow *last_row = &E.row[end_y];
-        
-        char *last_line_remainder = &last_row->chars[end_x];
-        int remainder_len = last_row->size - end_x;
-        
-        first_row->size = start_x;
-        first_row->chars[first_row->size] = '\0';
-        editorRowAppendString(first_row, last_line_remainder, remainder_len);
+/*********** input   *****************/
 
-        for (int i = start_y + 1; i <= end_y; i++) {
-            editorDelRow(start_y + 1);
-        }
-    }
-    
-    E.cy = start_y;
-    E.cx = start_x;
-    E.selecting = 0;
+// Pick up work finished in the background while waiting for a key.
+// Returns 1 if the screen needs to be redrawn.
+int editorPollEvents(void) {
+  int changed = 0;
+  changed |= editorLoaderPoll();
+  if (!prompt_open) changed |= editorFollowPoll();
+  if (!prompt_open) changed |= editorJournalPoll();
+  changed |= editorDiffPoll();
+  if (!prompt_open) changed |= editorDiskPoll();
+  return changed;
 }
 
-/*********** input   *****************/
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+// Enter is ignored while the input is empty unless allow_empty is set.
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allow_empty) {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
   size_t buflen = 0;
   buf[0] = '\0';
+  prompt_open = 1;
   while (1) {
     editorSetStatusMessage(prompt, buf);
     editorRefreshScreen();
@@ -656,11 +4697,13 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
       editorSetStatusMessage("");
       if (callback) callback(buf, c);
       free(buf);
+      prompt_open = 0;
       return NULL;
     } else if (c == '\r') {
-      if (buflen != 0) {
+      if (buflen != 0 || allow_empty) {
         editorSetStatusMessage("");
         if (callback) callback(buf, c);
+        prompt_open = 0;
         return buf;
       }
     } else if (!iscntrl(c) && c < 128) {
@@ -703,7 +4746,7 @@ void editorFindCallback(char *query, int key) {
     if (current == -1) current = E.numrows - 1;
     else if (current == E.numrows) current = 0;
     
-    erow *row = &E.row[current];
+    erow *row = editorRow(current);
     char *match = strcasestr_impl(row->chars, query);
     if (match) {
       last_match = current;
@@ -720,7 +4763,7 @@ void editorFind(void) {
   int saved_cy = E.cy;
   int saved_rowoff = E.rowoff;
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback, 0);
   
   free(E.highlight_query);
   E.highlight_query = NULL;
@@ -734,8 +4777,184 @@ void editorFind(void) {
   }
 }
 
+void editorReplace(void) {
+  if (E.loading) {
+    editorSetStatusMessage("Can't replace while the file is still loading");
+    return;
+  }
+  char *query = editorPrompt("Replace: %s (ESC to cancel)", NULL, 0);
+  if (query == NULL) return;
+  char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL, 1);
+  if (with == NULL) {
+    free(query);
+    return;
+  }
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  long count = editorReplaceAll(query, with);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  if (count == 0) {
+    editorSetStatusMessage("No match for '%s'", query);
+  } else {
+    editorSetStatusMessage("Replaced %ld in %d lines, %.3fs (%.0f/s), Ctrl-Z undoes",
+      count, E.undo.numrows, secs, secs > 0 ? count / secs : 0.0);
+  }
+  free(query);
+  free(with);
+}
+
+void editorGoto(void) {
+  char *input = editorPrompt("Go to line or N%%: %s (ESC to cancel)", NULL, 0);
+  if (input == NULL) return;
+
+  long long line;
+  size_t len = strlen(input);
+  if (input[len - 1] == '%') {
+    line = (long long)(atof(input) * E.numrows / 100.0) + 1;
+  } else {
+    line = atoll(input);
+  }
+  free(input);
+
+  if (line < 1) line = 1;
+  if (line > E.numrows) line = E.numrows > 0 ? E.numrows : 1;
+  E.cy = line - 1;
+  E.cx = 0;
+  // Put the target line at the top of the screen
+  E.rowoff = E.cy;
+}
+
+// Switch to a buffer by number or by part of its file name.
+void editorBufferPick(void) {
+  char *input = editorPrompt("Buffer number or name: %s (ESC to cancel)", NULL, 0);
+  if (input == NULL) return;
+
+  int pick = -1;
+  char *end;
+  long n = strtol(input, &end, 10);
+  if (*end == '\0' && n >= 1 && n <= buffers.num) {
+    pick = n - 1;
+  } else {
+    for (int i = 0; i < buffers.num && pick == -1; i++) {
+      if (buffers.list[i]->path && strstr(buffers.list[i]->path, input)) pick = i;
+    }
+  }
+  if (pick == -1) editorSetStatusMessage("No buffer matches '%s'", input);
+  else editorBufferSwitch(pick);
+  free(input);
+}
+
+// Ctrl-W followed by s splits the focused view into two stacked ones, v
+// splits it side by side, w moves to the next view and q closes it.
+void editorViewCommand(void) {
+  editorSetStatusMessage("View: s split, v split side by side, w next, q close");
+  editorRefreshScreen();
+  int c = editorReadKey();
+  editorSetStatusMessage("");
+  switch (c) {
+    case 's': editorViewSplit(0); break;
+    case 'v': editorViewSplit(1); break;
+    case 'w':
+    case CTRL_KEY('w'): editorViewNext(); break;
+    case 'q': editorViewClose(); break;
+  }
+}
+
+#define COMPLETE_MAX 5
+
+// Candidates for the word before the cursor. Repeated Ctrl-N cycles
+// through them as long as nothing else has been edited and the cursor
+// has stayed where the last one left it.
+static struct {
+  char *cands[COMPLETE_MAX];
+  int n;
+  int next;
+  int inserted;     // chars of the current candidate inserted after the prefix
+  unsigned long edits;
+  int buffer, cy, cx; // where the cursor was left
+} completion;
+
+static void completionClear(void) {
+  for (int i = 0; i < completion.n; i++) free(completion.cands[i]);
+  completion.n = 0;
+}
+
+static void completionMark(void) {
+  int count;
+  completion.edits = E.edits;
+  completion.buffer = editorBufferIndex(&count);
+  completion.cy = E.cy;
+  completion.cx = E.cx;
+}
+
+static int completionCurrent(void) {
+  int count;
+  return completion.n > 0 && completion.edits == E.edits &&
+    completion.buffer == editorBufferIndex(&count) &&
+    completion.cy == E.cy && completion.cx == E.cx;
+}
+
+// Length of the word fragment ending at the cursor
+static int editorWordPrefix(void) {
+  if (E.cy >= E.numrows) return 0;
+  erow *row = &E.row[E.cy];
+  int start = E.cx;
+  while (start > 0 && isWordChar((unsigned char)row->chars[start - 1])) start--;
+  return E.cx - start;
+}
+
+static int completionQuery(void) {
+  completionClear();
+  int plen = editorWordPrefix();
+  if (plen < 1) return 0;
+  completion.n = editorWordsComplete(&E.row[E.cy].chars[E.cx - plen], plen,
+    completion.cands, COMPLETE_MAX);
+  completion.next = 0;
+  completion.inserted = 0;
+  return completion.n;
+}
+
+void editorComplete(void) {
+  if (!completionCurrent()) {
+    if (!completionQuery()) {
+      editorSetStatusMessage("No completions");
+      return;
+    }
+  } else {
+    // Take back the previous candidate before inserting the next one
+    if (completion.inserted > 0) {
+      editorRowDelRange(&E.row[E.cy], E.cx - completion.inserted, completion.inserted);
+      E.cx -= completion.inserted;
+    }
+  }
+
+  int plen = editorWordPrefix();
+  char *cand = completion.cands[completion.next];
+  int clen = strlen(cand);
+  for (int i = plen; i < clen; i++) editorInsertChar(cand[i]);
+  completion.inserted = clen - plen;
+  editorSetStatusMessage("Completion %d/%d", completion.next + 1, completion.n);
+  completion.next = (completion.next + 1) % completion.n;
+  completionMark();
+}
+
+// After typing part of a word, list what Ctrl-N would offer.
+void editorCompleteHint(void) {
+  if (editorWordPrefix() < WORD_MIN_LEN || !completionQuery()) return;
+  char msg[80];
+  int len = snprintf(msg, sizeof(msg), "Ctrl-N:");
+  for (int i = 0; i < completion.n && len < (int)sizeof(msg); i++) {
+    len += snprintf(msg + len, sizeof(msg) - len, " %s", completion.cands[i]);
+  }
+  editorSetStatusMessage("%s", msg);
+  completionMark();
+}
+
 void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
 
   switch (key) {
     case ARROW_LEFT:
@@ -760,18 +4979,58 @@ void editorMoveCursor(int key) {
       break;
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = (E.cy >= E.numrows) ? NULL : editorRow(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) {
     E.cx = rowlen;
   }
 }
 
+// Keys that leave the buffer alone and so still work in viewer mode
+static int editorIsViewKey(int c) {
+  switch (c) {
+    case CTRL_KEY('q'):
+    case CTRL_KEY('f'):
+    case CTRL_KEY('g'):
+    case CTRL_KEY('t'):
+    case CTRL_KEY('o'):
+    case CTRL_KEY('p'):
+    case CTRL_KEY('e'):
+    case CTRL_KEY('w'):
+    case CTRL_KEY('c'):
+    case CTRL_KEY('b'):
+    case CTRL_KEY('l'):
+    case '\x1b':
+    case HOME_KEY:
+    case END_KEY:
+    case PAGE_UP:
+    case PAGE_DOWN:
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+      return 1;
+  }
+  return 0;
+}
+
 void editorProcessKeypress(void) {
   int c = editorReadKey();
 
+  if (E.viewer && !editorIsViewKey(c)) {
+    editorSetStatusMessage("Read-only viewer mode");
+    return;
+  }
+  // Loaded rows are appended at the end, below anything typed meanwhile,
+  // and a swap file is only offered for recovery once loading is done
+  if (E.loading && !editorIsViewKey(c)) {
+    editorSetStatusMessage("Can't edit while the file is still loading");
+    return;
+  }
+
   switch (c) {
     case CTRL_KEY('q'):
+      editorBufferCloseAll();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -785,17 +5044,59 @@ void editorProcessKeypress(void) {
       editorFind();
       break;
 
+    case CTRL_KEY('g'):
+      editorGoto();
+      break;
+
+    case CTRL_KEY('t'):
+      if (E.follow) {
+        editorFollowStop();
+        editorSetStatusMessage("Follow mode OFF");
+      } else {
+        editorFollowStart();
+        if (E.follow) editorSetStatusMessage("Follow mode ON");
+      }
+      break;
+
+    case CTRL_KEY('r'):
+      editorReplace();
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('o'):
+    case CTRL_KEY('p'):
+      {
+        int n;
+        int cur = editorBufferIndex(&n);
+        editorBufferSwitch((cur + (c == CTRL_KEY('o') ? 1 : n - 1)) % n);
+        completionClear();
+      }
+      break;
+
+    case CTRL_KEY('e'):
+      editorBufferPick();
+      break;
+
+    case CTRL_KEY('w'):
+      editorViewCommand();
+      completionClear();
+      break;
+
     case '\r':
       editorInsertNewline();
       break;
 
     case BACKSPACE:
     case CTRL_KEY('h'):
-      editorDelChar();
+      if (!editorCursorsApply(NULL, 0, -1)) editorDelChar();
       break;
 
     case DEL_KEY:
       {
+        if (editorCursorsApply(NULL, 0, 1)) break;
         if (E.cy >= E.numrows) break;
         erow *row = &E.row[E.cy];
 
@@ -811,11 +5112,13 @@ void editorProcessKeypress(void) {
 
     case HOME_KEY:
       E.cx = 0;
+      if (E.ncursors) editorCursorsMove(c);
       break;
     
     case END_KEY:
       if (E.cy < E.numrows)
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRow(E.cy)->size;
+      if (E.ncursors) editorCursorsMove(c);
       break;
 
     case PAGE_UP:
@@ -832,6 +5135,7 @@ void editorProcessKeypress(void) {
     case ARROW_LEFT:
     case ARROW_RIGHT:
       editorMoveCursor(c);
+      if (E.ncursors) editorCursorsMove(c);
       break;
     
     case CTRL_KEY('c'): // Copy
@@ -842,7 +5146,7 @@ void editorProcessKeypress(void) {
         editorSetStatusMessage("Copied selection to clipboard");
       } else if (E.cy < E.numrows) {
         free(E.clipboard);
-        E.clipboard = strdup(E.row[E.cy].chars);
+        E.clipboard = strdup(editorRow(E.cy)->chars);
         editorSetStatusMessage("Copied line to clipboard");
       }
       break;
@@ -885,52 +5189,103 @@ void editorProcessKeypress(void) {
         editorSetStatusMessage("Selection mode OFF");
       } else {
         E.selecting = 1;
+        E.block = 0;
         E.sel_start_x = E.cx;
         E.sel_start_y = E.cy;
         editorSetStatusMessage("Selection mode ON. Press ESC to cancel.");
       }
       break;
 
+    case CTRL_KEY('l'): // Begin/End block selection
+      if (E.selecting && E.block) {
+        E.selecting = 0;
+        editorSetStatusMessage("Block selection OFF");
+      } else {
+        E.selecting = 1;
+        E.block = 1;
+        E.sel_start_x = E.cx;
+        E.sel_start_y = E.cy;
+        editorSetStatusMessage("Block selection ON. Type to edit every row of it.");
+      }
+      break;
+
+    case CTRL_KEY('k'):
+      editorCursorsAdd();
+      break;
+
     case '\x1b': // Escape key
       if (E.selecting) {
         E.selecting = 0;
         editorSetStatusMessage("Selection cancelled");
+      } else if (E.ncursors) {
+        editorCursorsClear();
+        editorSetStatusMessage("Back to one cursor");
       }
       break;
 
+    case CTRL_KEY('n'):
+      editorComplete();
+      break;
+
+    case CTRL_KEY('d'):
+      editorDiffToggleBase();
+      break;
+
     default:
+      {
+        char ch = c;
+        if (editorCursorsApply(&ch, 1, 0)) break;
+      }
       editorInsertChar(c);
+      if (c < 128 && isWordChar(c)) editorCompleteHint();
       break;
   }
 }
 /*** init ***/
 
 void initEditor(void) {
-  E.cx = 0;
-  E.cy = 0;
-  E.rowoff = 0;
-  E.coloff = 0;
-  E.numrows = 0;
-  E.row = NULL;
-  E.filename = NULL;
+  bufferResetConfig();
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.highlight_query = NULL;
-  E.sel_start_x = -1;
-  E.sel_start_y = -1;
-  E.selecting = 0;
   E.clipboard = NULL;
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-  E.screenrows -= 2;
+  if (getWindowSize(&E.termrows, &E.termcols) == -1) die("getWindowSize");
+  E.screenrows = E.termrows - 2;
+  E.screencols = E.termcols;
 }
 
 int main(int argc, char *argv[]) {
-  enableRawMode();
   initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  int argi = 1;
+  for (; argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0'; argi++) {
+    if (strcmp(argv[argi], "-R") == 0) {
+      buffers.viewer = 1;
+    } else if (strcmp(argv[argi], "-f") == 0) {
+      buffers.follow = 1;
+    } else {
+      fprintf(stderr, "Usage: %s [-R] [-f] [file | -]...\n", argv[0]);
+      exit(1);
+    }
   }
+  int from_stdin = -1;
+  for (; argi < argc; argi++) {
+    if (strcmp(argv[argi], "-") == 0) {
+      if (from_stdin != -1) {
+        fprintf(stderr, "%s: standard input can only be read once\n", argv[0]);
+        exit(1);
+      }
+      from_stdin = buffers.num;
+    }
+    editorBufferAdd(argv[argi]);
+  }
+  if (buffers.num == 0) editorBufferAdd(NULL);
+  // Opening "-" moves stdin over to the terminal, so it can't wait until
+  // its buffer is first switched to
+  if (from_stdin != -1) editorBufferSwitch(from_stdin);
+  editorBufferSwitch(0);
+  enableRawMode();
+  buffers.started = 1;
 
   while (1) {
     editorRefreshScreen();